@@ -0,0 +1,96 @@
+#ifndef LIRC_MQTT_ADMISSIONCONTROL_H
+#define LIRC_MQTT_ADMISSIONCONTROL_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace lm {
+    /**
+     * Predicts how long a new command waits for a device worker: the rest of the
+     * command in flight plus the queued commands that will still run, at the
+     * average service time. Of the queued commands for a toggle only the latest
+     * runs, the others are skipped as superseded.
+     */
+    class AdmissionControl {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+    private:
+        std::mutex _sync;
+        // Queued sequenced commands per toggle
+        std::map<std::string, size_t> _queuedToggles;
+        size_t _queuedUnsequenced = 0;
+        // Sequenced toggle of the command in flight, empty if there is none or it is not sequenced
+        std::string _runningToggle;
+        Clock::time_point _runningUntil;
+        // Moving average of the time a command takes to execute
+        int64_t _serviceTimeUs = 0;
+
+    public:
+        // toggleName of a sequenced command, empty otherwise
+        long predictedWaitMs(const std::string& toggleName) {
+            std::unique_lock<std::mutex> lock(_sync);
+            int64_t waitUs = 0;
+            auto now = Clock::now();
+            // A newer target for the running toggle takes over after its current press
+            if (_runningUntil > now && (toggleName.empty() || toggleName != _runningToggle)) {
+                waitUs += std::chrono::duration_cast<std::chrono::microseconds>(_runningUntil - now).count();
+            }
+            size_t queued = _queuedUnsequenced;
+            for (const auto& entry : _queuedToggles) {
+                if (entry.first != toggleName) {
+                    queued++;
+                }
+            }
+            waitUs += static_cast<int64_t>(queued) * _serviceTimeUs;
+            return static_cast<long>(waitUs / 1000);
+        }
+
+        void queued(const std::string& toggleName) {
+            std::unique_lock<std::mutex> lock(_sync);
+            if (toggleName.empty()) {
+                _queuedUnsequenced++;
+            } else {
+                _queuedToggles[toggleName]++;
+            }
+        }
+
+        // Until its plan is known the command is expected to take the average service time
+        void started(const std::string& toggleName) {
+            std::unique_lock<std::mutex> lock(_sync);
+            if (toggleName.empty()) {
+                _queuedUnsequenced--;
+            } else {
+                auto it = _queuedToggles.find(toggleName);
+                if (--it->second == 0) {
+                    _queuedToggles.erase(it);
+                }
+            }
+            _runningToggle = toggleName;
+            _runningUntil = Clock::now() + std::chrono::microseconds(_serviceTimeUs);
+        }
+
+        // Refines the end of the command in flight from its plan or its progress
+        void expectRemaining(Clock::duration remaining) {
+            std::unique_lock<std::mutex> lock(_sync);
+            _runningUntil = Clock::now() + remaining;
+        }
+
+        // serviceTime of a command that executed, zero for skipped and expired ones
+        void finished(Clock::duration serviceTime) {
+            std::unique_lock<std::mutex> lock(_sync);
+            auto sampleUs = std::chrono::duration_cast<std::chrono::microseconds>(serviceTime).count();
+            if (sampleUs > 0) {
+                // Exponential moving average with weight 1/8 for the new sample
+                _serviceTimeUs = _serviceTimeUs == 0 ? sampleUs : _serviceTimeUs + (sampleUs - _serviceTimeUs) / 8;
+            }
+            _runningToggle.clear();
+            _runningUntil = Clock::time_point();
+        }
+    };
+}
+
+#endif //LIRC_MQTT_ADMISSIONCONTROL_H
@@ -0,0 +1,241 @@
+#include "AirtimeScheduler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sched.h>
+#include <iostream>
+#include <utility>
+
+namespace lm {
+
+    const uint64_t AirtimeScheduler::VIRTUAL_TIME_SCALE;
+    const long AirtimeScheduler::PRECISE_WAIT_US;
+
+    AirtimeScheduler::AirtimeScheduler(const DeviceConfigTable& config, const std::string& lircdSocketPath, long minFrameGapMs, int realtimePriority, std::shared_ptr<Tracer> tracer) :
+        _config(config), _lirc(lircdSocketPath), _minFrameGap(minFrameGapMs), _realtimePriority(realtimePriority), _tracer(std::move(tracer)) {
+        _thread = std::thread(&AirtimeScheduler::run, this);
+    }
+
+    AirtimeScheduler::~AirtimeScheduler() {
+        {
+            std::unique_lock<std::mutex> lock(_sync);
+            _bShutdown = true;
+        }
+        _cvRequest.notify_all();
+        _thread.join();
+    }
+
+    void AirtimeScheduler::addDevice(const std::string &deviceName, long controlIntervalMs, unsigned weight) {
+        std::unique_lock<std::mutex> lock(_sync);
+        DeviceSlot& device = _devices[deviceName];
+        device.controlInterval = std::chrono::milliseconds(controlIntervalMs);
+        device.weight = std::max(weight, 1u);
+    }
+
+    bool AirtimeScheduler::send(const std::string &deviceName, uint32_t command, AirtimePriority priority, uint64_t traceId) {
+        Request request;
+        request.command = command;
+        request.priority = priority;
+        request.traceId = traceId;
+        return submit(deviceName, request);
+    }
+
+    bool AirtimeScheduler::hold(const std::string &deviceName, uint32_t command, std::chrono::milliseconds duration, AirtimePriority priority, uint64_t traceId) {
+        Request request;
+        request.command = command;
+        request.hold = duration;
+        request.priority = priority;
+        request.traceId = traceId;
+        return submit(deviceName, request);
+    }
+
+    bool AirtimeScheduler::submit(const std::string &deviceName, Request &request) {
+        request.enqueued = Clock::now();
+
+        std::unique_lock<std::mutex> lock(_sync);
+        auto deviceIt = _devices.find(deviceName);
+        if (deviceIt == _devices.end() || _bShutdown) {
+            return false;
+        }
+
+        // A device becoming active starts at the current virtual time, idle time earns no credit
+        DeviceSlot& device = deviceIt->second;
+        if (device.pending.empty()) {
+            device.virtualTime = std::max(device.virtualTime, _virtualTime);
+        }
+        device.pending.push_back(&request);
+        _cvRequest.notify_one();
+
+        _cvDone.wait(lock, [&request] { return request.done; });
+        return request.success;
+    }
+
+    std::map<std::string, AirtimeStats> AirtimeScheduler::stats() {
+        std::unique_lock<std::mutex> lock(_sync);
+        std::map<std::string, AirtimeStats> rtn;
+        for (const auto& device : _devices) {
+            rtn.insert(std::make_pair(device.first, device.second.stats));
+        }
+        return rtn;
+    }
+
+    size_t AirtimeScheduler::gapBucket(std::chrono::microseconds deviation) {
+        static const long limitsUs[] = {0, 100, 500, 1000, 5000, 20000};
+        size_t bucket = 0;
+        while (bucket < GAP_BUCKETS - 1 && deviation.count() >= limitsUs[bucket]) {
+            bucket++;
+        }
+        return bucket;
+    }
+
+    const char* AirtimeScheduler::gapBucketName(size_t bucket) {
+        static const char* names[] = {"early", "<100us", "<500us", "<1ms", "<5ms", "<20ms", ">=20ms"};
+        return bucket < GAP_BUCKETS ? names[bucket] : "";
+    }
+
+    void AirtimeScheduler::waitUntil(std::unique_lock<std::mutex> &lock, Clock::time_point deadline) {
+        auto preciseWait = std::chrono::microseconds(PRECISE_WAIT_US);
+        if (deadline - Clock::now() > preciseWait) {
+            _cvRequest.wait_until(lock, deadline - preciseWait);
+            return;
+        }
+
+        // steady_clock is CLOCK_MONOTONIC, sleeping on the absolute deadline does not
+        // accumulate wake-up latency. Requests arriving meanwhile are seen right after.
+        auto sinceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+        timespec ts{};
+        ts.tv_sec = static_cast<time_t>(sinceEpoch.count() / 1000000000);
+        ts.tv_nsec = static_cast<long>(sinceEpoch.count() % 1000000000);
+        lock.unlock();
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+        }
+        lock.lock();
+    }
+
+    bool AirtimeScheduler::sendHold(const std::string &deviceName, const LircCommand &command, std::chrono::milliseconds duration) {
+        // lircd repeats the frame until SEND_STOP
+        std::string button = _config.arena().str(command.button);
+        if (!_lirc.send("SEND_START " + deviceName + " " + button + "\n")) {
+            return false;
+        }
+        std::this_thread::sleep_for(duration);
+        if (!_lirc.send("SEND_STOP " + deviceName + " " + button + "\n")) {
+            return false;
+        }
+        std::cout << "Lirc control was held for " << duration.count() << "ms" << std::endl;
+        return true;
+    }
+
+    void AirtimeScheduler::run() {
+        if (_realtimePriority > 0) {
+            sched_param param{};
+            param.sched_priority = _realtimePriority;
+            int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+            if (error != 0) {
+                std::cerr << "Could not set real-time priority " << _realtimePriority << " for the transmit thread: " << std::strerror(error) << std::endl;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(_sync);
+        for (;;) {
+            auto now = Clock::now();
+            auto best = _devices.end();
+            auto earliest = Clock::time_point::max();
+            bool anyPending = false;
+
+            for (auto it = _devices.begin(); it != _devices.end(); ++it) {
+                DeviceSlot& device = it->second;
+                if (device.pending.empty()) {
+                    continue;
+                }
+                anyPending = true;
+
+                auto eligibleAt = device.lastSent + device.controlInterval;
+                if (eligibleAt > now) {
+                    earliest = std::min(earliest, eligibleAt);
+                    continue;
+                }
+
+                if (best == _devices.end()) {
+                    best = it;
+                    continue;
+                }
+                AirtimePriority priority = device.pending.front()->priority;
+                AirtimePriority bestPriority = best->second.pending.front()->priority;
+                if (priority < bestPriority || (priority == bestPriority && device.virtualTime < best->second.virtualTime)) {
+                    best = it;
+                }
+            }
+
+            if (!anyPending) {
+                if (_bShutdown) {
+                    return;
+                }
+                _cvRequest.wait(lock);
+                continue;
+            }
+
+            if (best == _devices.end()) {
+                waitUntil(lock, earliest);
+                continue;
+            }
+
+            // Re-evaluate after the gap, a more urgent request may arrive meanwhile
+            auto frameAt = _lastFrame + _minFrameGap;
+            if (frameAt > now) {
+                waitUntil(lock, frameAt);
+                continue;
+            }
+
+            DeviceSlot& device = best->second;
+            Request* request = device.pending.front();
+            device.pending.pop_front();
+
+            auto wait = std::chrono::duration_cast<std::chrono::microseconds>(now - request->enqueued);
+            device.stats.frames++;
+            device.stats.totalWait += wait;
+            device.stats.maxWait = std::max(device.stats.maxWait, wait);
+
+            // Only frames held back by pacing say something about its precision
+            auto eligibleAt = device.lastSent + device.controlInterval;
+            bool paced = device.lastSent != Clock::time_point() && request->enqueued <= eligibleAt;
+
+            _virtualTime = device.virtualTime;
+            device.virtualTime += VIRTUAL_TIME_SCALE / device.weight;
+
+            lock.unlock();
+            const LircCommand& command = _config.command(request->command);
+            // Only build span details for sampled commands
+            std::string button = request->traceId != 0 ? _config.arena().str(command.button) : std::string();
+            _tracer->record(request->traceId, "airtime_wait", button, request->enqueued, now);
+            bool success;
+            Clock::time_point written;
+            {
+                TraceScope span(_tracer.get(), request->traceId, "lirc_send", button);
+                written = Clock::now();
+                if (request->hold.count() > 0) {
+                    success = sendHold(best->first, command, request->hold);
+                } else {
+                    success = _lirc.send(_config.arena().c_str(command.sendOnce), command.sendOnce.length);
+                }
+            }
+            lock.lock();
+
+            // The gap between the actual presses, the scheduling decision may lag behind the deadline
+            if (paced) {
+                auto gap = std::chrono::duration_cast<std::chrono::microseconds>(written - device.lastWritten);
+                device.stats.gapHistogram[gapBucket(gap - device.controlInterval)]++;
+            }
+            device.lastWritten = written;
+            device.lastSent = Clock::now();
+            _lastFrame = device.lastSent;
+            request->success = success;
+            request->done = true;
+            _cvDone.notify_all();
+        }
+    }
+
+} // lm
@@ -0,0 +1,119 @@
+#ifndef LIRC_MQTT_AIRTIMESCHEDULER_H
+#define LIRC_MQTT_AIRTIMESCHEDULER_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "DeviceConfig.h"
+#include "LircConnection.h"
+#include "Tracer.h"
+
+namespace lm {
+
+    enum class AirtimePriority : uint8_t {
+        // Single presses like power or mute
+        Interactive = 0,
+        // Long press sequences like volume sweeps
+        Bulk = 1
+    };
+
+    // Buckets of the gap between the writes of two paced frames of a device minus its controlIntervalMs
+    const size_t GAP_BUCKETS = 7;
+
+    struct AirtimeStats {
+        uint64_t frames = 0;
+        std::chrono::microseconds totalWait{0};
+        std::chrono::microseconds maxWait{0};
+        std::array<uint64_t, GAP_BUCKETS> gapHistogram{};
+    };
+
+    /**
+     * Owns the IR emitter behind one lircd socket. All devices send their buttons
+     * through a single transmit thread, which keeps a minimum gap between any two
+     * frames, honours each device's control interval and picks the next frame by
+     * priority first and weighted fair share between devices second.
+     */
+    class AirtimeScheduler {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Request {
+            // Index of DeviceConfigTable::command()
+            uint32_t command;
+            // Held buttons occupy the emitter for the whole duration
+            std::chrono::milliseconds hold{0};
+            AirtimePriority priority;
+            uint64_t traceId;
+            Clock::time_point enqueued;
+            bool done = false;
+            bool success = false;
+        };
+
+        struct DeviceSlot {
+            std::chrono::milliseconds controlInterval{0};
+            uint64_t weight = 1;
+            uint64_t virtualTime = 0;
+            Clock::time_point lastSent;
+            // When the last frame was written to lircd
+            Clock::time_point lastWritten;
+            std::deque<Request*> pending;
+            AirtimeStats stats;
+        };
+
+        static const uint64_t VIRTUAL_TIME_SCALE = 1 << 16;
+        // Waits closer to the deadline than this sleep on the absolute time instead of the condition
+        static const long PRECISE_WAIT_US = 2000;
+
+        const DeviceConfigTable& _config;
+        // Only used by the transmit thread
+        LircConnection _lirc;
+        std::chrono::milliseconds _minFrameGap;
+        int _realtimePriority;
+        std::shared_ptr<Tracer> _tracer;
+
+        std::mutex _sync;
+        std::condition_variable _cvRequest;
+        std::condition_variable _cvDone;
+        std::map<std::string, DeviceSlot> _devices;
+        Clock::time_point _lastFrame;
+        uint64_t _virtualTime = 0;
+        bool _bShutdown = false;
+        std::thread _thread;
+
+        void run();
+        void waitUntil(std::unique_lock<std::mutex>& lock, Clock::time_point deadline);
+        bool sendHold(const std::string& deviceName, const LircCommand& command, std::chrono::milliseconds duration);
+        bool submit(const std::string& deviceName, Request& request);
+
+    public:
+        // A realtimePriority > 0 runs the transmit thread with SCHED_FIFO at that priority
+        // config must be sealed and outlive the scheduler
+        AirtimeScheduler(const DeviceConfigTable& config, const std::string& lircdSocketPath, long minFrameGapMs, int realtimePriority, std::shared_ptr<Tracer> tracer);
+        ~AirtimeScheduler();
+
+        // Devices must be added before the first send
+        void addDevice(const std::string& deviceName, long controlIntervalMs, unsigned weight);
+
+        // Blocks until the button was sent, returns false if lircd failed or on shutdown
+        bool send(const std::string& deviceName, uint32_t command, AirtimePriority priority, uint64_t traceId = 0);
+
+        // Like send, but holds the button down for duration
+        bool hold(const std::string& deviceName, uint32_t command, std::chrono::milliseconds duration, AirtimePriority priority, uint64_t traceId = 0);
+
+        std::map<std::string, AirtimeStats> stats();
+
+        // Negative deviations, frames closer together than the control interval, are "early"
+        static size_t gapBucket(std::chrono::microseconds deviation);
+        static const char* gapBucketName(size_t bucket);
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_AIRTIMESCHEDULER_H
@@ -0,0 +1,227 @@
+#include "BufferedTransport.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include "rapidjson/document.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+namespace lm {
+
+    BufferedTransport::BufferedTransport(std::unique_ptr<Transport> transport, size_t maxTopics, std::string persistPath) :
+        _transport(std::move(transport)), _maxTopics(std::max<size_t>(maxTopics, 1)), _persistPath(std::move(persistPath)) {
+        _transport->setHandler(this);
+        load();
+    }
+
+    bool BufferedTransport::connect() {
+        return _transport->connect();
+    }
+
+    void BufferedTransport::disconnect() {
+        {
+            std::unique_lock<std::mutex> lock(_sync);
+            _connected = false;
+        }
+        _transport->disconnect();
+    }
+
+    void BufferedTransport::subscribe(const std::string &topicFilter, int qos) {
+        _transport->subscribe(topicFilter, qos);
+    }
+
+    bool BufferedTransport::publish(const std::string &topic, const std::string &payload, int qos, bool retained) {
+        bool connected;
+        {
+            std::unique_lock<std::mutex> lock(_sync);
+            connected = _connected;
+        }
+        if (connected && _transport->publish(topic, payload, qos, retained)) {
+            // A value buffered after an earlier failed publish is outdated now
+            std::unique_lock<std::mutex> lock(_sync);
+            if (_buffer.erase(topic) > 0) {
+                persist();
+            }
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(_sync);
+        uint64_t dropped = _dropped;
+        buffer(topic, payload, qos, retained);
+        persist();
+        return dropped == _dropped;
+    }
+
+    std::vector<TransportMessage> BufferedTransport::pending() {
+        std::unique_lock<std::mutex> lock(_sync);
+        std::vector<TransportMessage> rtn;
+        for (const auto& entry : orderedEntries()) {
+            TransportMessage message;
+            message.topic = entry.first;
+            message.payload = entry.second.payload;
+            message.qos = entry.second.qos;
+            message.retained = entry.second.retained;
+            rtn.push_back(message);
+        }
+        return rtn;
+    }
+
+    void BufferedTransport::buffer(const std::string &topic, const std::string &payload, int qos, bool retained) {
+        auto it = _buffer.find(topic);
+        if (it == _buffer.end() && _buffer.size() >= _maxTopics) {
+            auto oldest = std::min_element(_buffer.begin(), _buffer.end(),
+                                           [](const std::pair<const std::string, Entry>& a, const std::pair<const std::string, Entry>& b) {
+                return a.second.order < b.second.order;
+            });
+            std::cout << "Outbound buffer full, dropping update of " << oldest->first << std::endl;
+            _buffer.erase(oldest);
+            _dropped++;
+        }
+
+        Entry& entry = _buffer[topic];
+        entry.payload = payload;
+        entry.qos = qos;
+        entry.retained = retained;
+        entry.order = _nextOrder++;
+    }
+
+    std::vector<std::pair<std::string, BufferedTransport::Entry>> BufferedTransport::orderedEntries() const {
+        std::vector<std::pair<std::string, Entry>> entries(_buffer.begin(), _buffer.end());
+        std::sort(entries.begin(), entries.end(), [](const std::pair<std::string, Entry>& a, const std::pair<std::string, Entry>& b) {
+            return a.second.order < b.second.order;
+        });
+        return entries;
+    }
+
+    void BufferedTransport::flush() {
+        for (;;) {
+            std::vector<std::pair<std::string, Entry>> entries;
+            {
+                std::unique_lock<std::mutex> lock(_sync);
+                if (_buffer.empty()) {
+                    _connected = true;
+                    persist();
+                    return;
+                }
+                entries = orderedEntries();
+                _buffer.clear();
+            }
+
+            std::cout << "Flushing " << entries.size() << " buffered message(s)" << std::endl;
+            for (size_t i = 0; i < entries.size(); i++) {
+                const auto& entry = entries[i];
+                if (_transport->publish(entry.first, entry.second.payload, entry.second.qos, entry.second.retained)) {
+                    continue;
+                }
+
+                // Lost the connection again, keep what is left unless it was updated meanwhile
+                std::unique_lock<std::mutex> lock(_sync);
+                for (size_t j = i; j < entries.size(); j++) {
+                    if (_buffer.find(entries[j].first) == _buffer.end()) {
+                        buffer(entries[j].first, entries[j].second.payload, entries[j].second.qos, entries[j].second.retained);
+                    }
+                }
+                persist();
+                return;
+            }
+        }
+    }
+
+    void BufferedTransport::persist() {
+        if (_persistPath.empty()) {
+            return;
+        }
+        if (_buffer.empty()) {
+            std::remove(_persistPath.c_str());
+            return;
+        }
+
+        rapidjson::Document document;
+        document.SetArray();
+        auto& allocator = document.GetAllocator();
+        for (const auto& entry : orderedEntries()) {
+            rapidjson::Value message(rapidjson::kObjectType);
+            message.AddMember("topic", entry.first, allocator);
+            message.AddMember("payload", entry.second.payload, allocator);
+            message.AddMember("qos", entry.second.qos, allocator);
+            message.AddMember("retained", entry.second.retained, allocator);
+            document.GetArray().PushBack(message, allocator);
+        }
+
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+        document.Accept(writer);
+
+        // Replace the file atomically, a crash leaves either the old or the new buffer
+        std::string tmpPath = _persistPath + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::trunc);
+            out << buffer.GetString();
+            if (!out) {
+                std::cerr << "Error writing outbound buffer to " << tmpPath << std::endl;
+                return;
+            }
+        }
+        if (std::rename(tmpPath.c_str(), _persistPath.c_str()) != 0) {
+            std::cerr << "Error replacing outbound buffer file " << _persistPath << std::endl;
+        }
+    }
+
+    void BufferedTransport::load() {
+        if (_persistPath.empty()) {
+            return;
+        }
+        std::ifstream in(_persistPath);
+        if (!in) {
+            return;
+        }
+        std::stringstream content;
+        content << in.rdbuf();
+
+        rapidjson::Document document;
+        document.Parse(content.str());
+        if (document.HasParseError() || !document.IsArray()) {
+            std::cerr << "Ignoring invalid outbound buffer file " << _persistPath << std::endl;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(_sync);
+        for (const auto& message : document.GetArray()) {
+            if (!message.IsObject() || !message.HasMember("topic") || !message.HasMember("payload")) {
+                continue;
+            }
+            buffer(message["topic"].GetString(), message["payload"].GetString(),
+                   message.HasMember("qos") ? message["qos"].GetInt() : 0,
+                   message.HasMember("retained") && message["retained"].GetBool());
+        }
+        std::cout << "Restored " << _buffer.size() << " buffered message(s) from " << _persistPath << std::endl;
+    }
+
+    void BufferedTransport::connected() {
+        flush();
+        if (_handler != nullptr) {
+            _handler->connected();
+        }
+    }
+
+    void BufferedTransport::connectionLost(const std::string &cause) {
+        {
+            std::unique_lock<std::mutex> lock(_sync);
+            _connected = false;
+        }
+        if (_handler != nullptr) {
+            _handler->connectionLost(cause);
+        }
+    }
+
+    void BufferedTransport::messageArrived(const TransportMessage &message) {
+        if (_handler != nullptr) {
+            _handler->messageArrived(message);
+        }
+    }
+
+} // lm
@@ -0,0 +1,76 @@
+#ifndef LIRC_MQTT_BUFFEREDTRANSPORT_H
+#define LIRC_MQTT_BUFFEREDTRANSPORT_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Transport.h"
+
+namespace lm {
+
+    /**
+     * Transport decorator buffering publishes while the connection is down.
+     * Only the latest payload per topic is kept, so memory is bounded by the
+     * number of topics no matter how long the outage lasts. On reconnect the
+     * buffer is flushed in the order the topics were last updated, before the
+     * handler is told about the connection. A successful publish of a topic drops
+     * its buffered value, e.g. one kept after the backend rejected a publish while
+     * connected. Optionally the buffer is mirrored to
+     * a file, which makes it survive a restart during an outage.
+     */
+    class BufferedTransport : public Transport, public TransportHandler {
+    private:
+        struct Entry {
+            std::string payload;
+            int qos;
+            bool retained;
+            // Position in the flush order, the last update of a topic goes last
+            uint64_t order;
+        };
+
+        std::unique_ptr<Transport> _transport;
+        size_t _maxTopics;
+        std::string _persistPath;
+        TransportHandler* _handler = nullptr;
+
+        std::mutex _sync;
+        bool _connected = false;
+        std::map<std::string, Entry> _buffer;
+        uint64_t _nextOrder = 0;
+        uint64_t _dropped = 0;
+
+        void buffer(const std::string& topic, const std::string& payload, int qos, bool retained);
+        // Caller holds _sync
+        std::vector<std::pair<std::string, Entry>> orderedEntries() const;
+        void persist();
+        void load();
+        void flush();
+
+        void connected() override;
+        void connectionLost(const std::string& cause) override;
+        void messageArrived(const TransportMessage& message) override;
+
+    public:
+        // maxTopics bounds the buffer, an empty persistPath keeps it in memory only
+        BufferedTransport(std::unique_ptr<Transport> transport, size_t maxTopics, std::string persistPath);
+
+        void setHandler(TransportHandler* handler) override {
+            _handler = handler;
+        }
+
+        bool connect() override;
+        void disconnect() override;
+        void subscribe(const std::string& topicFilter, int qos) override;
+        // Returns false only if the message had to be dropped to keep the buffer bounded
+        bool publish(const std::string& topic, const std::string& payload, int qos, bool retained) override;
+
+        // Messages not yet delivered, e.g. restored from the file at startup
+        std::vector<TransportMessage> pending();
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_BUFFEREDTRANSPORT_H
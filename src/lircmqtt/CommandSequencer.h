@@ -0,0 +1,40 @@
+#ifndef LIRC_MQTT_COMMANDSEQUENCER_H
+#define LIRC_MQTT_COMMANDSEQUENCER_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace lm {
+    /**
+     * Tracks the latest command per toggle of a device, so a queued or running
+     * command can detect that a newer command for the same toggle superseded it.
+     */
+    class CommandSequencer {
+        std::mutex _sync;
+        std::map<std::string, uint64_t> _latest;
+        uint64_t _next = 0;
+
+    public:
+        // Sequence of actions without a target state (pauses, buttons, macros), never superseded
+        static const uint64_t UNSEQUENCED = 0;
+
+        uint64_t issue(const std::string& toggleName) {
+            std::unique_lock<std::mutex> lock(_sync);
+            _latest[toggleName] = ++_next;
+            return _next;
+        }
+
+        bool isSuperseded(const std::string& toggleName, uint64_t sequence) {
+            if (sequence == UNSEQUENCED) {
+                return false;
+            }
+            std::unique_lock<std::mutex> lock(_sync);
+            auto it = _latest.find(toggleName);
+            return it != _latest.end() && it->second != sequence;
+        }
+    };
+}
+
+#endif //LIRC_MQTT_COMMANDSEQUENCER_H
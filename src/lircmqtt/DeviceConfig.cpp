@@ -0,0 +1,495 @@
+#include "DeviceConfig.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+    bool parseNumber(const std::string& str, double& rtnNumber) {
+        if (str.empty()) {
+            return false;
+        }
+        char* end;
+        rtnNumber = std::strtod(str.c_str(), &end);
+        return *end == '\0' && std::isfinite(rtnNumber);
+    }
+}
+
+namespace lm {
+
+    const int32_t DeviceConfigTable::NOT_FOUND;
+
+    StringArena::StringArena() {
+        // Offset 0 is the empty string
+        _data.push_back('\0');
+    }
+
+    ArenaString StringArena::intern(const std::string &str) {
+        if (str.empty()) {
+            return ArenaString{0, 0};
+        }
+
+        auto it = _index.find(str);
+        if (it != _index.end()) {
+            return it->second;
+        }
+
+        ArenaString rtn{static_cast<uint32_t>(_data.size()), static_cast<uint32_t>(str.length())};
+        _data.insert(_data.end(), str.begin(), str.end());
+        _data.push_back('\0');
+        _index.insert(std::make_pair(str, rtn));
+        return rtn;
+    }
+
+    void StringArena::seal() {
+        std::unordered_map<std::string, ArenaString>().swap(_index);
+        _data.shrink_to_fit();
+    }
+
+    size_t StringArena::memoryUsage() const {
+        return _data.capacity();
+    }
+
+    uint32_t DeviceConfigTable::addStrings(const std::vector<std::string> &strings) {
+        auto begin = static_cast<uint32_t>(_strings.size());
+        for (const auto& str : strings) {
+            _strings.push_back(_arena.intern(str));
+        }
+        return begin;
+    }
+
+    int32_t DeviceConfigTable::addCommand(const std::string &deviceName, const std::string &button) {
+        if (button.empty()) {
+            return NOT_FOUND;
+        }
+
+        std::string sendOnce = "SEND_ONCE " + deviceName + " " + button + "\n";
+        auto it = _commandIndex.find(sendOnce);
+        if (it != _commandIndex.end()) {
+            return static_cast<int32_t>(it->second);
+        }
+
+        LircCommand command{};
+        command.button = _arena.intern(button);
+        command.sendOnce = _arena.intern(sendOnce);
+        _commands.push_back(command);
+        auto index = static_cast<uint32_t>(_commands.size() - 1);
+        _commandIndex.insert(std::make_pair(sendOnce, index));
+        return static_cast<int32_t>(index);
+    }
+
+    uint32_t DeviceConfigTable::addCommands(const std::string &deviceName, const std::vector<std::string> &buttons) {
+        auto begin = static_cast<uint32_t>(_commandLists.size());
+        for (const auto& button : buttons) {
+            int32_t command = addCommand(deviceName, button);
+            if (command != NOT_FOUND) {
+                _commandLists.push_back(static_cast<uint32_t>(command));
+            }
+        }
+        return begin;
+    }
+
+    bool DeviceConfigTable::addMacro(const DeviceConfig &device, const MacroDefinition &macroDefinition, std::string &rtnError) {
+        MacroConfig macro{};
+        macro.name = _arena.intern(macroDefinition.name);
+        macro.stepsBegin = static_cast<uint32_t>(_macroSteps.size());
+        macro.effectsBegin = static_cast<uint32_t>(_macroEffects.size());
+
+        uint32_t offsetMs = 0;
+        for (const auto& stepDefinition : macroDefinition.steps) {
+            offsetMs += stepDefinition.delayMs;
+
+            std::vector<uint32_t> commands;
+            int32_t toggleIndex = NOT_FOUND;
+            int32_t valueIndex = NOT_FOUND;
+            if (!stepDefinition.button.empty() && !stepDefinition.toggle.empty()) {
+                rtnError = "a step has both a button and a toggle";
+            } else if (stepDefinition.repeat == 0) {
+                rtnError = "a step has repeat 0";
+            } else if (!stepDefinition.button.empty()) {
+                // Only the device's buttons, a typo must not send a command lircd rejects at run time
+                int32_t command = findButton(device, stepDefinition.button);
+                if (command == NOT_FOUND) {
+                    rtnError = "unknown button " + stepDefinition.button;
+                } else {
+                    commands.push_back(static_cast<uint32_t>(command));
+                }
+            } else if (!stepDefinition.toggle.empty()) {
+                toggleIndex = findToggle(device, stepDefinition.toggle);
+                if (toggleIndex == NOT_FOUND) {
+                    rtnError = "unknown toggle " + stepDefinition.toggle;
+                } else {
+                    // Up/down toggles depend on the state at run time, only mappings have fixed commands
+                    const ToggleConfig& toggle = _toggles[toggleIndex];
+                    valueIndex = findValue(toggle, stepDefinition.value);
+                    if (valueIndex < static_cast<int32_t>(toggle.valuesCount) || _mappings[toggle.mappingsBegin + valueIndex - toggle.valuesCount].commandsCount == 0) {
+                        rtnError = "toggle " + stepDefinition.toggle + " has no buttons mapped to " + stepDefinition.value;
+                    } else {
+                        const ValueButtonMapping& mapping = _mappings[toggle.mappingsBegin + valueIndex - toggle.valuesCount];
+                        for (uint32_t i = 0; i < mapping.commandsCount; i++) {
+                            commands.push_back(_commandLists[mapping.commandsBegin + i]);
+                        }
+                    }
+                }
+            }
+            if (!rtnError.empty()) {
+                _macroSteps.resize(macro.stepsBegin);
+                _macroEffects.resize(macro.effectsBegin);
+                return false;
+            }
+
+            for (uint32_t i = 0; i < stepDefinition.repeat; i++) {
+                for (auto command : commands) {
+                    _macroSteps.push_back(MacroStep{offsetMs, command});
+                }
+            }
+            if (toggleIndex != NOT_FOUND) {
+                MacroEffect effect{};
+                effect.toggleIndex = static_cast<uint32_t>(toggleIndex);
+                effect.valueIndex = valueIndex;
+                effect.stepsDone = static_cast<uint32_t>(_macroSteps.size()) - macro.stepsBegin;
+                effect.resetState = resetsStateOn(_toggles[toggleIndex], stepDefinition.value);
+                _macroEffects.push_back(effect);
+            }
+        }
+
+        macro.stepsCount = static_cast<uint32_t>(_macroSteps.size()) - macro.stepsBegin;
+        macro.effectsCount = static_cast<uint32_t>(_macroEffects.size()) - macro.effectsBegin;
+        if (macro.stepsCount == 0) {
+            rtnError = "it sends no commands";
+            _macroEffects.resize(macro.effectsBegin);
+            return false;
+        }
+        _macros.push_back(macro);
+        return true;
+    }
+
+    bool DeviceConfigTable::addDevice(const DeviceDefinition &definition, std::vector<std::string> &rtnWarnings) {
+        auto byNameIt = std::lower_bound(_devicesByName.begin(), _devicesByName.end(), definition.name,
+                                         [this](uint32_t index, const std::string& name) {
+            return _arena.compare(_devices[index].name, name) < 0;
+        });
+        if (byNameIt != _devicesByName.end() && _arena.equals(_devices[*byNameIt].name, definition.name)) {
+            return false;
+        }
+
+        DeviceConfig device{};
+        device.name = _arena.intern(definition.name);
+        device.node = _arena.intern(definition.node);
+        device.controlIntervalMs = definition.controlIntervalMs;
+        device.airtimeWeight = definition.airtimeWeight;
+        device.deadlineMs = definition.deadlineMs;
+        device.buttonsBegin = addCommands(definition.name, definition.buttons);
+        device.buttonsCount = static_cast<uint32_t>(_commandLists.size()) - device.buttonsBegin;
+        std::vector<uint32_t> buttonsByName(_commandLists.begin() + device.buttonsBegin, _commandLists.end());
+        std::sort(buttonsByName.begin(), buttonsByName.end(), [this](uint32_t a, uint32_t b) {
+            return _arena.str(_commands[a].button) < _arena.str(_commands[b].button);
+        });
+        device.buttonsByNameBegin = static_cast<uint32_t>(_commandLists.size());
+        _commandLists.insert(_commandLists.end(), buttonsByName.begin(), buttonsByName.end());
+
+        // Sort by name, on duplicate names the first definition wins
+        std::vector<const ToggleDefinition*> toggleDefinitions;
+        for (const auto& toggleDefinition : definition.toggles) {
+            toggleDefinitions.push_back(&toggleDefinition);
+        }
+        std::stable_sort(toggleDefinitions.begin(), toggleDefinitions.end(),
+                         [](const ToggleDefinition* a, const ToggleDefinition* b) { return a->name < b->name; });
+        toggleDefinitions.erase(std::unique(toggleDefinitions.begin(), toggleDefinitions.end(),
+                                            [](const ToggleDefinition* a, const ToggleDefinition* b) { return a->name == b->name; }),
+                                toggleDefinitions.end());
+
+        device.togglesBegin = static_cast<uint32_t>(_toggles.size());
+        device.togglesCount = static_cast<uint32_t>(toggleDefinitions.size());
+
+        for (const auto* toggleDefinition : toggleDefinitions) {
+            ToggleConfig toggle{};
+            toggle.name = _arena.intern(toggleDefinition->name);
+            toggle.buttonForward = _arena.intern(toggleDefinition->buttonForward);
+            toggle.buttonBackwards = _arena.intern(toggleDefinition->buttonBackwards);
+            toggle.commandForward = addCommand(definition.name, toggleDefinition->buttonForward);
+            toggle.commandBackwards = addCommand(definition.name, toggleDefinition->buttonBackwards);
+            toggle.wrapAround = toggleDefinition->wrapAround;
+            toggle.deadlineMs = toggleDefinition->deadlineMs;
+            toggle.delay = "sleep" == toggleDefinition->name;
+
+            if ("range" == toggleDefinition->type) {
+                toggle.type = ToggleType::Range;
+            } else if ("switch" == toggleDefinition->type) {
+                toggle.type = ToggleType::Switch;
+            } else if ("enum" == toggleDefinition->type) {
+                toggle.type = ToggleType::Enum;
+            } else {
+                toggle.type = ToggleType::Other;
+            }
+
+            bool mappedButtons = false;
+            for (const auto& mappingDefinition : toggleDefinition->valueButtonMappings) {
+                mappedButtons = mappedButtons || !mappingDefinition.second.empty();
+            }
+
+            // Ranges declared the old way as "values": [min, max] or as every value in even steps,
+            // ranges selecting values by their buttons keep the values as listed
+            int32_t rangeMin = toggleDefinition->min;
+            int32_t rangeMax = toggleDefinition->max;
+            int32_t rangeStep = toggleDefinition->step;
+            toggle.numeric = toggleDefinition->numeric;
+            if (!toggle.numeric && !mappedButtons && ToggleType::Range == toggle.type && toggleDefinition->values.size() >= 2) {
+                std::vector<int32_t> numbers;
+                double number;
+                for (const auto& value : toggleDefinition->values) {
+                    if (!parseNumber(value, number) || number != std::round(number)) {
+                        break;
+                    }
+                    numbers.push_back(static_cast<int32_t>(number));
+                }
+                bool evenSteps = numbers.size() == toggleDefinition->values.size();
+                for (size_t i = 2; evenSteps && i < numbers.size(); i++) {
+                    evenSteps = numbers[i] - numbers[i - 1] == numbers[1] - numbers[0];
+                }
+                if (evenSteps && numbers.size() == 2) {
+                    toggle.numeric = true;
+                    rangeMin = numbers[0];
+                    rangeMax = numbers[1];
+                } else if (evenSteps && numbers[1] > numbers[0]) {
+                    toggle.numeric = true;
+                    rangeMin = numbers.front();
+                    rangeMax = numbers.back();
+                    rangeStep = numbers[1] - numbers[0];
+                }
+            }
+
+            if (toggle.numeric) {
+                toggle.rangeMin = std::min(rangeMin, rangeMax);
+                toggle.rangeStep = std::max(rangeStep, 1);
+                toggle.holdMsPerStep = toggleDefinition->holdMsPerStep;
+                toggle.holdMinSteps = toggleDefinition->holdMinSteps;
+                toggle.valuesCount = static_cast<uint32_t>((static_cast<int64_t>(std::max(rangeMin, rangeMax)) - toggle.rangeMin) / toggle.rangeStep + 1);
+                toggle.valuesBegin = 0;
+            } else {
+                toggle.rangeStep = 1;
+                toggle.valuesCount = static_cast<uint32_t>(toggleDefinition->values.size());
+                toggle.valuesBegin = addStrings(toggleDefinition->values);
+            }
+            toggle.resetStateOnCount = static_cast<uint32_t>(toggleDefinition->resetStateOn.size());
+            toggle.resetStateOnBegin = addStrings(toggleDefinition->resetStateOn);
+
+            // Mappings are sorted by value, on duplicates the first one with buttons wins
+            std::vector<const std::pair<std::string, std::vector<std::string>>*> mappingDefinitions;
+            for (const auto& mappingDefinition : toggleDefinition->valueButtonMappings) {
+                mappingDefinitions.push_back(&mappingDefinition);
+            }
+            std::stable_sort(mappingDefinitions.begin(), mappingDefinitions.end(),
+                             [](const std::pair<std::string, std::vector<std::string>>* a, const std::pair<std::string, std::vector<std::string>>* b) {
+                return a->first < b->first;
+            });
+
+            // Numeric toggles are reached by stepping only
+            if (toggle.numeric) {
+                if (mappedButtons) {
+                    rtnWarnings.push_back("button mappings of numeric toggle " + toggleDefinition->name);
+                }
+                mappingDefinitions.clear();
+            }
+
+            toggle.mappingsBegin = static_cast<uint32_t>(_mappings.size());
+            for (size_t i = 0; i < mappingDefinitions.size(); i++) {
+                const auto* mappingDefinition = mappingDefinitions[i];
+                if (toggle.mappingsCount > 0 && _arena.equals(_mappings.back().value, mappingDefinition->first)) {
+                    if (_mappings.back().commandsCount > 0 || mappingDefinition->second.empty()) {
+                        continue;
+                    }
+                    _mappings.pop_back();
+                    toggle.mappingsCount--;
+                }
+                ValueButtonMapping mapping{};
+                mapping.value = _arena.intern(mappingDefinition->first);
+                mapping.commandsBegin = addCommands(definition.name, mappingDefinition->second);
+                mapping.commandsCount = static_cast<uint32_t>(_commandLists.size()) - mapping.commandsBegin;
+                _mappings.push_back(mapping);
+                toggle.mappingsCount++;
+            }
+            for (uint32_t i = 0; i < toggle.mappingsCount; i++) {
+                toggle.buttonMappings = toggle.buttonMappings || _mappings[toggle.mappingsBegin + i].commandsCount > 0;
+            }
+
+            toggle.initialValue = NOT_FOUND;
+            if (toggle.mappingsCount > 0) {
+                toggle.initialValue = findValue(toggle, toggleDefinition->valueButtonMappings[0].first);
+            } else if (toggle.valuesCount > 0) {
+                toggle.initialValue = 0;
+            }
+
+            _toggles.push_back(toggle);
+        }
+
+        // Macros are compiled against the toggles above, sorted by name, on duplicate names the first one wins
+        std::vector<const MacroDefinition*> macroDefinitions;
+        for (const auto& macroDefinition : definition.macros) {
+            macroDefinitions.push_back(&macroDefinition);
+        }
+        std::stable_sort(macroDefinitions.begin(), macroDefinitions.end(),
+                         [](const MacroDefinition* a, const MacroDefinition* b) { return a->name < b->name; });
+
+        device.macrosBegin = static_cast<uint32_t>(_macros.size());
+        for (const auto* macroDefinition : macroDefinitions) {
+            if (device.macrosCount > 0 && _arena.equals(_macros.back().name, macroDefinition->name)) {
+                rtnWarnings.push_back("duplicate macro " + macroDefinition->name);
+                continue;
+            }
+            std::string error;
+            if (!addMacro(device, *macroDefinition, error)) {
+                rtnWarnings.push_back("invalid macro " + macroDefinition->name + ": " + error);
+                continue;
+            }
+            device.macrosCount++;
+        }
+
+        _devices.push_back(device);
+        _devicesByName.insert(byNameIt, static_cast<uint32_t>(_devices.size() - 1));
+        return true;
+    }
+
+    void DeviceConfigTable::seal() {
+        _arena.seal();
+        _devices.shrink_to_fit();
+        _devicesByName.shrink_to_fit();
+        _toggles.shrink_to_fit();
+        _mappings.shrink_to_fit();
+        _strings.shrink_to_fit();
+        _commands.shrink_to_fit();
+        _commandLists.shrink_to_fit();
+        _macros.shrink_to_fit();
+        _macroSteps.shrink_to_fit();
+        _macroEffects.shrink_to_fit();
+        std::unordered_map<std::string, uint32_t>().swap(_commandIndex);
+    }
+
+    int32_t DeviceConfigTable::findDevice(const std::string &name) const {
+        auto it = std::lower_bound(_devicesByName.begin(), _devicesByName.end(), name,
+                                   [this](uint32_t index, const std::string& n) {
+            return _arena.compare(_devices[index].name, n) < 0;
+        });
+        if (it == _devicesByName.end() || !_arena.equals(_devices[*it].name, name)) {
+            return NOT_FOUND;
+        }
+        return static_cast<int32_t>(*it);
+    }
+
+    int32_t DeviceConfigTable::findToggle(const DeviceConfig &device, const std::string &name) const {
+        auto begin = _toggles.begin() + device.togglesBegin;
+        auto end = begin + device.togglesCount;
+        auto it = std::lower_bound(begin, end, name, [this](const ToggleConfig& toggle, const std::string& n) {
+            return _arena.compare(toggle.name, n) < 0;
+        });
+        if (it == end || !_arena.equals(it->name, name)) {
+            return NOT_FOUND;
+        }
+        return static_cast<int32_t>(it - _toggles.begin());
+    }
+
+    int32_t DeviceConfigTable::findValue(const ToggleConfig &toggle, const std::string &value) const {
+        // Numbers are snapped to the nearest step within the range
+        if (toggle.numeric) {
+            double number;
+            if (!parseNumber(value, number)) {
+                return NOT_FOUND;
+            }
+            double index = std::round((number - toggle.rangeMin) / toggle.rangeStep);
+            return static_cast<int32_t>(std::max(0.0, std::min(index, static_cast<double>(toggle.valuesCount - 1))));
+        }
+
+        for (uint32_t i = 0; i < toggle.valuesCount; i++) {
+            if (_arena.equals(_strings[toggle.valuesBegin + i], value)) {
+                return static_cast<int32_t>(i);
+            }
+        }
+
+        auto begin = _mappings.begin() + toggle.mappingsBegin;
+        auto end = begin + toggle.mappingsCount;
+        auto it = std::lower_bound(begin, end, value, [this](const ValueButtonMapping& mapping, const std::string& v) {
+            return _arena.compare(mapping.value, v) < 0;
+        });
+        if (it == end || !_arena.equals(it->value, value)) {
+            return NOT_FOUND;
+        }
+        return static_cast<int32_t>(toggle.valuesCount + (it - begin));
+    }
+
+    bool DeviceConfigTable::resetsStateOn(const ToggleConfig &toggle, const std::string &value) const {
+        for (uint32_t i = 0; i < toggle.resetStateOnCount; i++) {
+            if (_arena.equals(_strings[toggle.resetStateOnBegin + i], value)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int32_t DeviceConfigTable::findButton(const DeviceConfig &device, const std::string &name) const {
+        auto begin = _commandLists.begin() + device.buttonsByNameBegin;
+        auto end = begin + device.buttonsCount;
+        auto it = std::lower_bound(begin, end, name, [this](uint32_t command, const std::string& n) {
+            return _arena.compare(_commands[command].button, n) < 0;
+        });
+        if (it == end || !_arena.equals(_commands[*it].button, name)) {
+            return NOT_FOUND;
+        }
+        return static_cast<int32_t>(*it);
+    }
+
+    int32_t DeviceConfigTable::findMacro(const DeviceConfig &device, const std::string &name) const {
+        auto begin = _macros.begin() + device.macrosBegin;
+        auto end = begin + device.macrosCount;
+        auto it = std::lower_bound(begin, end, name, [this](const MacroConfig& macro, const std::string& n) {
+            return _arena.compare(macro.name, n) < 0;
+        });
+        if (it == end || !_arena.equals(it->name, name)) {
+            return NOT_FOUND;
+        }
+        return static_cast<int32_t>(it - _macros.begin());
+    }
+
+    bool DeviceConfigTable::valueBounds(const ToggleConfig &toggle, int32_t &rtnMin, int32_t &rtnMax) const {
+        if (toggle.numeric) {
+            rtnMin = toggle.rangeMin;
+            rtnMax = rangeValue(toggle, static_cast<int32_t>(toggle.valuesCount) - 1);
+            return toggle.valuesCount > 0;
+        }
+
+        bool found = false;
+        double number;
+        for (uint32_t i = 0; i < toggle.valuesCount; i++) {
+            if (!parseNumber(_arena.str(_strings[toggle.valuesBegin + i]), number)) {
+                continue;
+            }
+            auto value = static_cast<int32_t>(std::lround(number));
+            rtnMin = found ? std::min(rtnMin, value) : value;
+            rtnMax = found ? std::max(rtnMax, value) : value;
+            found = true;
+        }
+        return found;
+    }
+
+    uint32_t DeviceConfigTable::deadlineMs(const DeviceConfig &device, const std::string &name) const {
+        int32_t toggleIndex = findToggle(device, name);
+        if (toggleIndex != NOT_FOUND && _toggles[toggleIndex].deadlineMs > 0) {
+            return _toggles[toggleIndex].deadlineMs;
+        }
+        return device.deadlineMs;
+    }
+
+    size_t DeviceConfigTable::memoryUsage() const {
+        return _arena.memoryUsage()
+            + _devices.capacity() * sizeof(DeviceConfig)
+            + _devicesByName.capacity() * sizeof(uint32_t)
+            + _toggles.capacity() * sizeof(ToggleConfig)
+            + _mappings.capacity() * sizeof(ValueButtonMapping)
+            + _strings.capacity() * sizeof(ArenaString)
+            + _commands.capacity() * sizeof(LircCommand)
+            + _commandLists.capacity() * sizeof(uint32_t)
+            + _macros.capacity() * sizeof(MacroConfig)
+            + _macroSteps.capacity() * sizeof(MacroStep)
+            + _macroEffects.capacity() * sizeof(MacroEffect);
+    }
+
+} // lm
@@ -0,0 +1,304 @@
+#ifndef LIRC_MQTT_DEVICECONFIG_H
+#define LIRC_MQTT_DEVICECONFIG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+
+namespace lm {
+
+    /**
+     * Reference to a string interned in a StringArena. Strings are stored null
+     * terminated, so the referenced characters can be handed to C APIs as is.
+     */
+    struct ArenaString {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    /**
+     * Append-only storage for all strings of the static device configuration.
+     * Identical strings (button names, values, ...) are stored only once.
+     */
+    class StringArena {
+    private:
+        std::vector<char> _data;
+        // Deduplication index, only needed while the configuration is loaded
+        std::unordered_map<std::string, ArenaString> _index;
+
+    public:
+        StringArena();
+
+        ArenaString intern(const std::string& str);
+
+        const char* c_str(ArenaString str) const {
+            return _data.data() + str.offset;
+        }
+
+        std::string str(ArenaString str) const {
+            return std::string(c_str(str), str.length);
+        }
+
+        bool equals(ArenaString str, const std::string& other) const {
+            return str.length == other.length() && other.compare(0, other.length(), c_str(str), str.length) == 0;
+        }
+
+        int compare(ArenaString str, const std::string& other) const {
+            return -other.compare(0, other.length(), c_str(str), str.length);
+        }
+
+        void seal();
+
+        size_t memoryUsage() const;
+    };
+
+    enum class ToggleType : uint8_t {
+        Other,
+        Range,
+        Switch,
+        Enum
+    };
+
+    /**
+     * Toggle configuration as read from the config file. Only used while loading,
+     * DeviceConfigTable::addDevice compiles it into the flat tables.
+     */
+    struct ToggleDefinition {
+        std::string name;
+        std::string type;
+        std::vector<std::string> values;
+        std::string buttonForward;
+        std::string buttonBackwards;
+        bool wrapAround = false;
+        // In config file order, the first mapping is the initial state
+        std::vector<std::pair<std::string, std::vector<std::string>>> valueButtonMappings;
+        std::vector<std::string> resetStateOn;
+        // Numeric range from min to max in steps, instead of a list of values
+        bool numeric = false;
+        int32_t min = 0;
+        int32_t max = 0;
+        int32_t step = 1;
+        // Time one step takes while the button is held, 0 always sends single presses
+        uint32_t holdMsPerStep = 0;
+        uint32_t holdMinSteps = 5;
+        // Maximum time a command may wait before it is sent, 0 uses the device's
+        uint32_t deadlineMs = 0;
+    };
+
+    /**
+     * One step of a macro: a button press, a toggle set to a value of its value
+     * button mappings, or (with neither) just a pause. delayMs is waited before the step.
+     */
+    struct MacroStepDefinition {
+        std::string button;
+        std::string toggle;
+        std::string value;
+        uint32_t delayMs = 0;
+        uint32_t repeat = 1;
+    };
+
+    struct MacroDefinition {
+        std::string name;
+        std::vector<MacroStepDefinition> steps;
+    };
+
+    struct DeviceDefinition {
+        std::string name;
+        // Node owning the device's emitter, empty if not sharded
+        std::string node;
+        std::vector<std::string> buttons;
+        long controlIntervalMs = 0;
+        unsigned airtimeWeight = 1;
+        // Maximum time a command may wait before it is sent, 0 waits forever
+        uint32_t deadlineMs = 0;
+        std::vector<ToggleDefinition> toggles;
+        std::vector<MacroDefinition> macros;
+    };
+
+    /**
+     * A button of a device with its lircd command pre-encoded at load time, so
+     * sending is a single write of these bytes.
+     */
+    struct LircCommand {
+        ArenaString button;
+        // "SEND_ONCE <device> <button>\n"
+        ArenaString sendOnce;
+    };
+
+    struct ValueButtonMapping {
+        ArenaString value;
+        // Range in DeviceConfigTable::commandList()
+        uint32_t commandsBegin;
+        uint32_t commandsCount;
+    };
+
+    /**
+     * A toggle addresses its states by value index: indices [0, valuesCount) are
+     * the plain values, the following mappingsCount indices the mapped values.
+     * Numeric toggles store no values, index i is the number rangeMin + i * rangeStep.
+     */
+    struct ToggleConfig {
+        ArenaString name;
+        ArenaString buttonForward;
+        ArenaString buttonBackwards;
+        // Commands of the buttons above, NOT_FOUND if there is no button
+        int32_t commandForward;
+        int32_t commandBackwards;
+        uint32_t valuesBegin;
+        uint32_t valuesCount;
+        uint32_t mappingsBegin;
+        uint32_t mappingsCount;
+        uint32_t resetStateOnBegin;
+        uint32_t resetStateOnCount;
+        int32_t initialValue;
+        int32_t rangeMin;
+        int32_t rangeStep;
+        uint32_t holdMsPerStep;
+        uint32_t holdMinSteps;
+        // 0 falls back to DeviceConfig::deadlineMs
+        uint32_t deadlineMs;
+        ToggleType type;
+        bool wrapAround;
+        bool numeric;
+        // Any of the mappings has buttons, values are set through the mappings instead of stepping
+        bool buttonMappings;
+        // Toggles named "sleep", the value is a pause in milliseconds instead of IR commands
+        bool delay;
+    };
+
+    /**
+     * A press of a compiled macro timeline, offsetMs is relative to the macro start.
+     */
+    struct MacroStep {
+        uint32_t offsetMs;
+        uint32_t command;
+    };
+
+    /**
+     * Toggle state a macro reaches once the first stepsDone steps of its timeline were sent.
+     */
+    struct MacroEffect {
+        uint32_t toggleIndex;
+        int32_t valueIndex;
+        uint32_t stepsDone;
+        bool resetState;
+    };
+
+    struct MacroConfig {
+        ArenaString name;
+        uint32_t stepsBegin;
+        uint32_t stepsCount;
+        uint32_t effectsBegin;
+        uint32_t effectsCount;
+    };
+
+    struct DeviceConfig {
+        ArenaString name;
+        ArenaString node;
+        // Toggles are sorted by name
+        uint32_t togglesBegin;
+        uint32_t togglesCount;
+        // Ranges in DeviceConfigTable::commandList(), in config order and sorted by button name
+        uint32_t buttonsBegin;
+        uint32_t buttonsByNameBegin;
+        uint32_t buttonsCount;
+        // Macros are sorted by name
+        uint32_t macrosBegin;
+        uint32_t macrosCount;
+        long controlIntervalMs;
+        // Share of the emitter's airtime relative to other devices
+        uint32_t airtimeWeight;
+        uint32_t deadlineMs;
+    };
+
+    /**
+     * Immutable (once sealed) configuration of all devices: one string arena and
+     * contiguous tables referencing each other by index.
+     */
+    class DeviceConfigTable {
+    private:
+        StringArena _arena;
+        std::vector<DeviceConfig> _devices;
+        std::vector<uint32_t> _devicesByName;
+        std::vector<ToggleConfig> _toggles;
+        std::vector<ValueButtonMapping> _mappings;
+        std::vector<ArenaString> _strings;
+        std::vector<LircCommand> _commands;
+        std::vector<uint32_t> _commandLists;
+        std::vector<MacroConfig> _macros;
+        std::vector<MacroStep> _macroSteps;
+        std::vector<MacroEffect> _macroEffects;
+        // Deduplication index by sendOnce, only needed while the configuration is loaded
+        std::unordered_map<std::string, uint32_t> _commandIndex;
+
+        uint32_t addStrings(const std::vector<std::string>& strings);
+        int32_t addCommand(const std::string& deviceName, const std::string& button);
+        uint32_t addCommands(const std::string& deviceName, const std::vector<std::string>& buttons);
+        bool addMacro(const DeviceConfig& device, const MacroDefinition& macroDefinition, std::string& rtnError);
+
+    public:
+        static const int32_t NOT_FOUND = -1;
+
+        // Returns false if a device with the same name was added before, invalid macros are skipped with a warning each
+        bool addDevice(const DeviceDefinition& definition, std::vector<std::string>& rtnWarnings);
+
+        void seal();
+
+        int32_t findDevice(const std::string& name) const;
+        int32_t findToggle(const DeviceConfig& device, const std::string& name) const;
+        int32_t findValue(const ToggleConfig& toggle, const std::string& value) const;
+        bool resetsStateOn(const ToggleConfig& toggle, const std::string& value) const;
+        // Static button of the device, returns its command index
+        int32_t findButton(const DeviceConfig& device, const std::string& name) const;
+        int32_t findMacro(const DeviceConfig& device, const std::string& name) const;
+        // Smallest and largest number among the toggle's values, false if there is none
+        bool valueBounds(const ToggleConfig& toggle, int32_t& rtnMin, int32_t& rtnMax) const;
+        // Deadline of commands for a toggle, button or macro of the device, 0 if there is none
+        uint32_t deadlineMs(const DeviceConfig& device, const std::string& name) const;
+
+        // Not for numeric toggles, see valueString
+        ArenaString valueAt(const ToggleConfig& toggle, int32_t valueIndex) const {
+            if (valueIndex < static_cast<int32_t>(toggle.valuesCount)) {
+                return _strings[toggle.valuesBegin + valueIndex];
+            }
+            return _mappings[toggle.mappingsBegin + valueIndex - toggle.valuesCount].value;
+        }
+
+        std::string valueString(const ToggleConfig& toggle, int32_t valueIndex) const {
+            if (toggle.numeric) {
+                return std::to_string(rangeValue(toggle, valueIndex));
+            }
+            return _arena.str(valueAt(toggle, valueIndex));
+        }
+
+        int32_t rangeValue(const ToggleConfig& toggle, int32_t valueIndex) const {
+            return toggle.rangeMin + valueIndex * toggle.rangeStep;
+        }
+
+        uint32_t valueCount(const ToggleConfig& toggle) const {
+            return toggle.valuesCount + toggle.mappingsCount;
+        }
+
+        const StringArena& arena() const { return _arena; }
+        const DeviceConfig& device(uint32_t index) const { return _devices[index]; }
+        const ToggleConfig& toggle(uint32_t index) const { return _toggles[index]; }
+        const ValueButtonMapping& mapping(uint32_t index) const { return _mappings[index]; }
+        ArenaString string(uint32_t index) const { return _strings[index]; }
+        const LircCommand& command(uint32_t index) const { return _commands[index]; }
+        uint32_t commandList(uint32_t index) const { return _commandLists[index]; }
+        const MacroConfig& macro(uint32_t index) const { return _macros[index]; }
+        const MacroStep& macroStep(uint32_t index) const { return _macroSteps[index]; }
+        const MacroEffect& macroEffect(uint32_t index) const { return _macroEffects[index]; }
+
+        size_t deviceCount() const { return _devices.size(); }
+        size_t toggleCount() const { return _toggles.size(); }
+        const std::vector<uint32_t>& devicesByName() const { return _devicesByName; }
+
+        size_t memoryUsage() const;
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_DEVICECONFIG_H
@@ -7,71 +7,94 @@
 #include <utility>
 #include <iostream>
 #include <algorithm>
+#include <cstdlib>
 
 namespace lm {
+
+    const int32_t DeviceStateManager::FREEFORM_VALUE;
+
     void DeviceStateManager::addDeviceState(const rapidjson::Value &json) {
 
-        DeviceState deviceState;
-        deviceState._name = json["deviceName"].GetString();
+        DeviceDefinition deviceDefinition;
+        deviceDefinition.name = json["deviceName"].GetString();
+        if (json.HasMember("node")) {
+            deviceDefinition.node = json["node"].GetString();
+        }
 
-        std::cout << "Adding device config for " << deviceState._name << std::endl;
+        std::cout << "Adding device config for " << deviceDefinition.name << std::endl;
 
         if (json.HasMember("buttons")) {
             for (const auto & buttonValue : json["buttons"].GetArray()) {
-                deviceState._buttons.emplace_back(buttonValue.GetString());
+                deviceDefinition.buttons.emplace_back(buttonValue.GetString());
             }
         }
 
         if (json.HasMember("controlIntervalMs")) {
-            deviceState._controlIntervalMs = json["controlIntervalMs"].GetInt64();
+            deviceDefinition.controlIntervalMs = json["controlIntervalMs"].GetInt64();
         } else {
-            deviceState._controlIntervalMs = 0;
+            deviceDefinition.controlIntervalMs = 0;
+        }
+
+        if (json.HasMember("airtimeWeight")) {
+            deviceDefinition.airtimeWeight = json["airtimeWeight"].GetUint();
+        }
+
+        if (json.HasMember("deadlineMs")) {
+            deviceDefinition.deadlineMs = json["deadlineMs"].GetUint();
         }
 
         for (const auto& deviceToggleJson : json["toggles"].GetArray()) {
-            DeviceToggle deviceToggle;
+            ToggleDefinition deviceToggle;
 
-            deviceToggle._name = deviceToggleJson["name"].GetString();
+            deviceToggle.name = deviceToggleJson["name"].GetString();
             if (deviceToggleJson.HasMember("buttonForward")) {
-                deviceToggle._button_forward = deviceToggleJson["buttonForward"].GetString();
+                deviceToggle.buttonForward = deviceToggleJson["buttonForward"].GetString();
             }
             if (deviceToggleJson.HasMember("buttonBackwards")) {
-                deviceToggle._button_backwards = deviceToggleJson["buttonBackwards"].GetString();
+                deviceToggle.buttonBackwards = deviceToggleJson["buttonBackwards"].GetString();
             }
             
-            deviceToggle._type = deviceToggleJson["type"].GetString();
+            deviceToggle.type = deviceToggleJson["type"].GetString();
 
             if (deviceToggleJson.HasMember("wrapAround")) {
-                deviceToggle._wrap_around = deviceToggleJson["wrapAround"].GetBool();
+                deviceToggle.wrapAround = deviceToggleJson["wrapAround"].GetBool();
             } else {
-                deviceToggle._wrap_around = false;
+                deviceToggle.wrapAround = false;
             }
 
             if (deviceToggleJson.HasMember("resetsStateOn")) {
                 for (const auto& resetState : deviceToggleJson["resetsStateOn"].GetArray()) {
-                    deviceToggle._reset_state_on.emplace_back(resetState.GetString());
+                    deviceToggle.resetStateOn.emplace_back(resetState.GetString());
                 }
             }
             
+            if (deviceToggleJson.HasMember("min") && deviceToggleJson.HasMember("max")) {
+                deviceToggle.numeric = true;
+                deviceToggle.min = deviceToggleJson["min"].GetInt();
+                deviceToggle.max = deviceToggleJson["max"].GetInt();
+            }
+            if (deviceToggleJson.HasMember("step")) {
+                deviceToggle.step = deviceToggleJson["step"].GetInt();
+            }
+            if (deviceToggleJson.HasMember("holdMsPerStep")) {
+                deviceToggle.holdMsPerStep = deviceToggleJson["holdMsPerStep"].GetUint();
+            }
+            if (deviceToggleJson.HasMember("holdMinSteps")) {
+                deviceToggle.holdMinSteps = deviceToggleJson["holdMinSteps"].GetUint();
+            }
+            if (deviceToggleJson.HasMember("deadlineMs")) {
+                deviceToggle.deadlineMs = deviceToggleJson["deadlineMs"].GetUint();
+            }
+
             if (deviceToggleJson.HasMember("values")) {
                 for (const auto &j: deviceToggleJson["values"].GetArray()) {
-                    deviceToggle._values.emplace_back(j.GetString());
-                }
-
-                if (!deviceToggle._values.empty()) {
-                    deviceToggle._initialState = deviceToggle._values[0];
-                    deviceToggle._state = deviceToggle._initialState;
+                    deviceToggle.values.emplace_back(j.GetString());
                 }
             }
 
             if (deviceToggleJson.HasMember("valueButtonMappings")) {
-                std::string initValue;
                 auto valueButtonMappings = deviceToggleJson["valueButtonMappings"].GetArray();
                 for (size_t j=0; j < valueButtonMappings.Size(); j++) {
-                    auto value = valueButtonMappings[j]["value"].GetString();
-                    if (j == 0) {
-                        initValue = value;
-                    }
                     std::vector<std::string> buttons;
                     if (valueButtonMappings[j].HasMember("button")) {
                         buttons.emplace_back(valueButtonMappings[j]["button"].GetString());
@@ -82,122 +105,355 @@ namespace lm {
                             buttons.emplace_back(buttonValue.GetString());
                         }
                     }
-                    if (!buttons.empty()) {
-                        deviceToggle._valueToButtonMappings.insert(std::make_pair(value, buttons));
-                    }
+                    deviceToggle.valueButtonMappings.emplace_back(valueButtonMappings[j]["value"].GetString(), buttons);
                 }
-                deviceToggle._initialState = initValue;
-                deviceToggle._state = deviceToggle._initialState;
             }
             
-            deviceState._toggles.insert(std::make_pair(deviceToggle._name, deviceToggle));
+            deviceDefinition.toggles.push_back(deviceToggle);
         }
+
+        if (json.HasMember("macros")) {
+            for (const auto& macroJson : json["macros"].GetArray()) {
+                MacroDefinition macro;
+                macro.name = macroJson["name"].GetString();
+                for (const auto& stepJson : macroJson["steps"].GetArray()) {
+                    MacroStepDefinition step;
+                    if (stepJson.HasMember("button")) {
+                        step.button = stepJson["button"].GetString();
+                    }
+                    if (stepJson.HasMember("toggle")) {
+                        step.toggle = stepJson["toggle"].GetString();
+                        step.value = stepJson["value"].GetString();
+                    }
+                    if (stepJson.HasMember("delayMs")) {
+                        step.delayMs = stepJson["delayMs"].GetUint();
+                    }
+                    if (stepJson.HasMember("repeat")) {
+                        step.repeat = stepJson["repeat"].GetUint();
+                    }
+                    macro.steps.push_back(step);
+                }
+                deviceDefinition.macros.push_back(macro);
+            }
+        }
+
         std::unique_lock<std::mutex> lock(ml);
-        _deviceStates.insert(std::make_pair(deviceState._name, deviceState));
+        std::vector<std::string> warnings;
+        if (!_config.addDevice(deviceDefinition, warnings)) {
+            std::cout << "WARN ignoring duplicate device config for " << deviceDefinition.name << std::endl;
+            return;
+        }
+        for (const auto& warning : warnings) {
+            std::cout << "WARN ignoring " << warning << " of device " << deviceDefinition.name << std::endl;
+        }
+
+        for (auto i = static_cast<uint32_t>(_toggleStates.size()); i < _config.toggleCount(); i++) {
+            _toggleStates.push_back(_config.toggle(i).initialValue);
+        }
     }
 
+    void DeviceStateManager::sealConfiguration() {
+        std::unique_lock<std::mutex> lock(ml);
+        _config.seal();
+        _toggleStates.shrink_to_fit();
+
+        // Devices no node runs are otherwise silently ignored
+        const std::vector<std::string>& nodes = _properties.nodes;
+        auto isKnownNode = [&nodes](const std::string& node) {
+            return nodes.empty() || std::find(nodes.begin(), nodes.end(), node) != nodes.end();
+        };
+        if (!_properties.nodeName.empty() && !isKnownNode(_properties.nodeName)) {
+            std::cout << "WARN node " << _properties.nodeName << " is not one of the configured nodes" << std::endl;
+        }
+        if (!_properties.defaultNode.empty() && !isKnownNode(_properties.defaultNode)) {
+            std::cout << "WARN default node " << _properties.defaultNode << " is not one of the configured nodes" << std::endl;
+        }
+        for (auto deviceIndex : _config.devicesByName()) {
+            const DeviceConfig& device = _config.device(deviceIndex);
+            std::string node = _config.arena().str(device.node);
+            if (node.empty() && !_properties.nodeName.empty() && _properties.defaultNode.empty()) {
+                std::cout << "WARN device " << _config.arena().str(device.name) << " has no node and no defaultNode is configured, no node runs it" << std::endl;
+            } else if (!node.empty() && !isKnownNode(node)) {
+                std::cout << "WARN device " << _config.arena().str(device.name) << " is assigned to unknown node " << node << ", no node runs it" << std::endl;
+            }
+        }
 
-    bool DeviceStateManager::moveToState(const std::string &deviceName, const std::string& toggleName, const std::string &value, std::vector<std::string>& rtnButton, int& rtnNumInvoke, bool& rtnResetState, long& rtnControlIntervalMs) {
+        if (!_properties.sharedStateName.empty()) {
+            _sharedState.reset(new SharedStateExport(_properties.sharedStateName));
+            if (!_sharedState->create(_config, _toggleStates)) {
+                _sharedState.reset();
+            }
+        }
+    }
+
+    void DeviceStateManager::exportStates(uint32_t begin, uint32_t count) {
+        if (_sharedState) {
+            _sharedState->update(_toggleStates, begin, count);
+        }
+    }
 
+    size_t DeviceStateManager::memoryUsage() {
         std::unique_lock<std::mutex> lock(ml);
+        size_t rtn = _config.memoryUsage() + _toggleStates.capacity() * sizeof(int32_t);
+        for (const auto& freeformState : _freeformStates) {
+            rtn += sizeof(freeformState) + freeformState.second.capacity();
+        }
+        return rtn;
+    }
 
-        auto deviceIt = _deviceStates.find(deviceName);
+    std::string DeviceStateManager::stateOf(uint32_t toggleIndex) const {
+        int32_t valueIndex = _toggleStates[toggleIndex];
+        if (valueIndex == FREEFORM_VALUE) {
+            auto freeformIt = _freeformStates.find(toggleIndex);
+            return freeformIt == _freeformStates.end() ? std::string() : freeformIt->second;
+        }
+        return _config.valueString(_config.toggle(toggleIndex), valueIndex);
+    }
 
-        if (deviceIt == _deviceStates.end()) {
-            return false;
+    void DeviceStateManager::assignState(uint32_t toggleIndex, const std::string &value) {
+        int32_t valueIndex = _config.findValue(_config.toggle(toggleIndex), value);
+        if (valueIndex == DeviceConfigTable::NOT_FOUND) {
+            _toggleStates[toggleIndex] = FREEFORM_VALUE;
+            _freeformStates[toggleIndex] = value;
+        } else {
+            _toggleStates[toggleIndex] = valueIndex;
+            _freeformStates.erase(toggleIndex);
         }
+        exportStates(toggleIndex, 1);
+    }
+
+    bool DeviceStateManager::moveToState(const std::string &deviceName, const std::string& toggleName, const std::string &value, std::vector<uint32_t>& rtnCommands, int& rtnNumInvoke, bool& rtnResetState, long& rtnControlIntervalMs, long& rtnHoldMs, long& rtnDelayMs) {
+
+        std::unique_lock<std::mutex> lock(ml);
 
-        auto toggleIt = deviceIt->second._toggles.find(toggleName);
+        int32_t deviceIndex = _config.findDevice(deviceName);
 
-        if (toggleIt == deviceIt->second._toggles.end()) {
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
             return false;
         }
 
-        rtnResetState = std::find(toggleIt->second._reset_state_on.begin(), toggleIt->second._reset_state_on.end(), value) != toggleIt->second._reset_state_on.end();
-        rtnControlIntervalMs = deviceIt->second._controlIntervalMs;
+        const DeviceConfig& device = _config.device(deviceIndex);
+        int32_t toggleIndex = _config.findToggle(device, toggleName);
+
+        rtnResetState = false;
+        rtnControlIntervalMs = device.controlIntervalMs;
+        rtnHoldMs = 0;
+        rtnDelayMs = 0;
+
+        if (toggleIndex == DeviceConfigTable::NOT_FOUND) {
+            int32_t command = _config.findButton(device, toggleName);
+            if (command == DeviceConfigTable::NOT_FOUND) {
+                return false;
+            }
+            rtnCommands.push_back(static_cast<uint32_t>(command));
+            rtnNumInvoke = 1;
+            return true;
+        }
+
+        const ToggleConfig& toggle = _config.toggle(toggleIndex);
+
+        rtnResetState = _config.resetsStateOn(toggle, value);
 
-        if (!toggleIt->second._valueToButtonMappings.empty()) {
-            return moveToButtonValueMapping(value, toggleIt->second, rtnButton, rtnNumInvoke);
-        } else if (!toggleIt->second._button_forward.empty() || !toggleIt->second._button_backwards.empty()) {
-            return moveToStateUpDown(value, toggleIt->second, rtnButton, rtnNumInvoke);
+        if (toggle.delay) {
+            char* end;
+            rtnDelayMs = std::strtol(value.c_str(), &end, 10);
+            rtnNumInvoke = 0;
+            return !value.empty() && *end == '\0' && rtnDelayMs >= 0;
+        }
+
+        if (toggle.buttonMappings) {
+            return moveToButtonValueMapping(value, toggle, rtnCommands, rtnNumInvoke);
+        } else if (toggle.commandForward != DeviceConfigTable::NOT_FOUND || toggle.commandBackwards != DeviceConfigTable::NOT_FOUND) {
+            if (!moveToStateUpDown(value, toggleIndex, rtnCommands, rtnNumInvoke)) {
+                return false;
+            }
+            // Long sweeps hold the button instead of pressing it step by step
+            if (toggle.holdMsPerStep > 0 && rtnNumInvoke >= static_cast<int>(toggle.holdMinSteps)) {
+                rtnHoldMs = static_cast<long>(rtnNumInvoke) * toggle.holdMsPerStep;
+            }
+            return true;
         } else {
             return false;
         }
     }
 
-    bool DeviceStateManager::moveToButtonValueMapping(const std::string& value, DeviceToggle &toggle, std::vector<std::string> &rtnButton, int &rtnNumInvoke) const {
-        auto mapping = toggle._valueToButtonMappings.find(value);
-        if (mapping == toggle._valueToButtonMappings.end()) {
+    bool DeviceStateManager::moveToButtonValueMapping(const std::string& value, const ToggleConfig &toggle, std::vector<uint32_t> &rtnCommands, int &rtnNumInvoke) const {
+        int32_t valueIndex = _config.findValue(toggle, value);
+        if (valueIndex < static_cast<int32_t>(toggle.valuesCount)) {
             return false;
         }
 
-        rtnButton = mapping->second;
+        const ValueButtonMapping& mapping = _config.mapping(toggle.mappingsBegin + valueIndex - toggle.valuesCount);
+        if (mapping.commandsCount == 0) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < mapping.commandsCount; i++) {
+            rtnCommands.push_back(_config.commandList(mapping.commandsBegin + i));
+        }
         rtnNumInvoke = 1;
         return true;
     }
     
-    bool DeviceStateManager::moveToStateUpDown(const std::string& value, DeviceToggle &toggle, std::vector<std::string> &rtnButton, int &rtnNumInvoke) const {
-        
-        if (toggle._state == value) {
+    bool DeviceStateManager::moveToStateUpDown(const std::string& value, uint32_t toggleIndex, std::vector<uint32_t> &rtnCommands, int &rtnNumInvoke) const {
+
+        if (stateOf(toggleIndex) == value) {
             rtnNumInvoke = 0;
             return true;
         }
 
-        int currentValue = 0;
-        int targetIndex = 0;
-        bool isAssigned = false;
+        uint32_t command;
+        int32_t currentValue;
+        int direction;
+        if (!planUpDown(value, toggleIndex, command, currentValue, direction, rtnNumInvoke)) {
+            return false;
+        }
+
+        rtnCommands.push_back(command);
+        return true;
+    }
 
-        for (int i=0; i < toggle._values.size(); i++) {
-            if (toggle._state == toggle._values.at(i)) {
-                currentValue = i;
-            }
+    bool DeviceStateManager::planUpDown(const std::string &value, uint32_t toggleIndex, uint32_t &rtnCommand, int32_t &rtnCurrentValue, int &rtnDirection, int &rtnNumInvoke) const {
 
-            if (value == toggle._values.at(i)) {
-                targetIndex = i;
-            }
+        const ToggleConfig& toggle = _config.toggle(toggleIndex);
+
+        // Unknown values are treated as the first value
+        int32_t currentValue = _toggleStates[toggleIndex];
+        if (currentValue < 0 || currentValue >= static_cast<int32_t>(toggle.valuesCount)) {
+            currentValue = 0;
+        }
+        int32_t targetIndex = _config.findValue(toggle, value);
+        if (toggle.numeric && targetIndex == DeviceConfigTable::NOT_FOUND) {
+            return false;
+        }
+        if (targetIndex < 0 || targetIndex >= static_cast<int32_t>(toggle.valuesCount)) {
+            targetIndex = 0;
         }
 
+        int32_t command;
         if (targetIndex > currentValue) {
-            rtnButton.emplace_back(toggle._button_forward);
+            command = toggle.commandForward;
+            rtnDirection = 1;
             rtnNumInvoke = targetIndex - currentValue;
-            isAssigned = !rtnButton.empty();
         } else {
-            rtnButton.emplace_back(toggle._button_backwards);
+            command = toggle.commandBackwards;
+            rtnDirection = -1;
             rtnNumInvoke = currentValue - targetIndex;
-            isAssigned = !rtnButton.empty();
         }
 
-        if (toggle._wrap_around && rtnButton.empty()) {
+        // Without a button for the required direction, go around the other way
+        if (command == DeviceConfigTable::NOT_FOUND && toggle.wrapAround) {
             if (targetIndex > currentValue) {
-                rtnButton.emplace_back(toggle._button_backwards);
-                //rtnNumInvoke = currentValue + (deviceIt->second._values.size() - targetIndex);
+                command = toggle.commandBackwards;
             } else {
-                rtnButton.emplace_back(toggle._button_forward);
+                command = toggle.commandForward;
             }
-            rtnNumInvoke = toggle._values.size() - currentValue + targetIndex;
-            isAssigned = true;
+            rtnDirection = -rtnDirection;
+            rtnNumInvoke = static_cast<int>(toggle.valuesCount) - rtnNumInvoke;
+        }
+
+        if (command == DeviceConfigTable::NOT_FOUND) {
+            return false;
+        }
+
+        rtnCommand = static_cast<uint32_t>(command);
+        rtnCurrentValue = currentValue;
+        return true;
+    }
+
+    bool DeviceStateManager::intermediateState(const std::string &deviceName, const std::string &toggleName, const std::string &value, int numInvokesDone, std::string &rtnValue) {
+
+        std::unique_lock<std::mutex> lock(ml);
+
+        int32_t deviceIndex = _config.findDevice(deviceName);
+
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
+            return false;
         }
 
-        return isAssigned;
+        int32_t toggleIndex = _config.findToggle(_config.device(deviceIndex), toggleName);
+
+        if (toggleIndex == DeviceConfigTable::NOT_FOUND) {
+            return false;
+        }
+
+        const ToggleConfig& toggle = _config.toggle(toggleIndex);
+
+        if (numInvokesDone == 0 || stateOf(toggleIndex) == value) {
+            rtnValue = stateOf(toggleIndex);
+            return true;
+        }
+
+        // Value button mappings are always reached with a single invoke
+        if (toggle.buttonMappings) {
+            return false;
+        }
+
+        uint32_t command;
+        int32_t currentValue;
+        int direction;
+        int numInvoke;
+        if (!planUpDown(value, toggleIndex, command, currentValue, direction, numInvoke)) {
+            return false;
+        }
+
+        auto valuesCount = static_cast<int32_t>(toggle.valuesCount);
+        int32_t valueIndex = ((currentValue + direction * numInvokesDone) % valuesCount + valuesCount) % valuesCount;
+        rtnValue = _config.valueString(toggle, valueIndex);
+        return true;
+    }
+
+    bool DeviceStateManager::applyMacro(const std::string &deviceName, uint32_t macroIndex, uint32_t stepsDone) {
+
+        std::unique_lock<std::mutex> lock(ml);
+
+        int32_t deviceIndex = _config.findDevice(deviceName);
+
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
+            return false;
+        }
+
+        const DeviceConfig& device = _config.device(deviceIndex);
+        const MacroConfig& macro = _config.macro(macroIndex);
+        bool changed = false;
+        for (uint32_t i = macro.effectsBegin; i < macro.effectsBegin + macro.effectsCount; i++) {
+            const MacroEffect& effect = _config.macroEffect(i);
+            if (effect.stepsDone > stepsDone) {
+                break;
+            }
+            if (effect.resetState) {
+                for (uint32_t j = device.togglesBegin; j < device.togglesBegin + device.togglesCount; j++) {
+                    _toggleStates[j] = _config.toggle(j).initialValue;
+                    _freeformStates.erase(j);
+                }
+            }
+            _toggleStates[effect.toggleIndex] = effect.valueIndex;
+            _freeformStates.erase(effect.toggleIndex);
+            changed = true;
+        }
+        if (changed) {
+            exportStates(device.togglesBegin, device.togglesCount);
+        }
+        return changed;
     }
 
     bool DeviceStateManager::setState(const std::string &deviceName, const std::string &toggleName, const std::string &value) {
 
         std::unique_lock<std::mutex> lock(ml);
 
-        auto deviceIt = _deviceStates.find(deviceName);
+        int32_t deviceIndex = _config.findDevice(deviceName);
 
-        if (deviceIt == _deviceStates.end()) {
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
             return false;
         }
 
-        auto toggleIt = deviceIt->second._toggles.find(toggleName);
+        int32_t toggleIndex = _config.findToggle(_config.device(deviceIndex), toggleName);
 
-        if (toggleIt == deviceIt->second._toggles.end()) {
+        if (toggleIndex == DeviceConfigTable::NOT_FOUND) {
             return false;
         }
 
-        toggleIt->second._state = value;
+        assignState(toggleIndex, value);
 
         return true;
     }
@@ -206,34 +462,197 @@ namespace lm {
 
         std::unique_lock<std::mutex> lock(ml);
 
-        auto deviceIt = _deviceStates.find(deviceName);
+        int32_t deviceIndex = _config.findDevice(deviceName);
 
-        if (deviceIt == _deviceStates.end()) {
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
             return false;
         }
 
-        for (auto& deviceState : deviceIt->second._toggles) {
-            deviceState.second._state = deviceState.second._initialState;
+        const DeviceConfig& device = _config.device(deviceIndex);
+        for (uint32_t i = device.togglesBegin; i < device.togglesBegin + device.togglesCount; i++) {
+            _toggleStates[i] = _config.toggle(i).initialValue;
+            _freeformStates.erase(i);
         }
+        exportStates(device.togglesBegin, device.togglesCount);
 
         return true;
     }
 
+    bool DeviceStateManager::applyReceivedButton(const std::string &deviceName, const std::string &button) {
+
+        std::unique_lock<std::mutex> lock(ml);
+
+        int32_t deviceIndex = _config.findDevice(deviceName);
+
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
+            return false;
+        }
+
+        const DeviceConfig& device = _config.device(deviceIndex);
+        const StringArena& arena = _config.arena();
+
+        bool changed = false;
+        for (uint32_t i = device.togglesBegin; i < device.togglesBegin + device.togglesCount; i++) {
+            const ToggleConfig& toggle = _config.toggle(i);
+            int32_t valueIndex = _toggleStates[i];
+
+            if (toggle.buttonMappings) {
+                // Only single button mappings identify a value
+                std::vector<int32_t> matches;
+                for (uint32_t j = 0; j < toggle.mappingsCount; j++) {
+                    const ValueButtonMapping& mapping = _config.mapping(toggle.mappingsBegin + j);
+                    if (mapping.commandsCount == 1 && arena.equals(_config.command(_config.commandList(mapping.commandsBegin)).button, button)) {
+                        matches.push_back(static_cast<int32_t>(toggle.valuesCount + j));
+                    }
+                }
+                if (matches.size() == 1) {
+                    valueIndex = matches[0];
+                } else if (matches.size() == 2 && (valueIndex == matches[0] || valueIndex == matches[1])) {
+                    // One button toggling between two values, e.g. POWER for ON and OFF
+                    valueIndex = valueIndex == matches[0] ? matches[1] : matches[0];
+                } else if (!matches.empty()) {
+                    // The order the device cycles through the values is unknown
+                    std::cout << "Ignoring " << button << " for " << deviceName << ", it maps to several values of "
+                              << arena.str(toggle.name) << std::endl;
+                }
+            } else if (toggle.valuesCount > 0) {
+                auto valuesCount = static_cast<int32_t>(toggle.valuesCount);
+                int32_t currentValue = valueIndex >= 0 && valueIndex < valuesCount ? valueIndex : 0;
+                int direction = 0;
+                if (toggle.buttonForward.length > 0 && arena.equals(toggle.buttonForward, button)) {
+                    direction = 1;
+                } else if (toggle.buttonBackwards.length > 0 && arena.equals(toggle.buttonBackwards, button)) {
+                    direction = -1;
+                }
+                if (direction != 0) {
+                    valueIndex = currentValue + direction;
+                    if (toggle.wrapAround) {
+                        valueIndex = (valueIndex + valuesCount) % valuesCount;
+                    } else {
+                        valueIndex = std::max(0, std::min(valueIndex, valuesCount - 1));
+                    }
+                }
+            }
+
+            if (valueIndex == _toggleStates[i]) {
+                continue;
+            }
+
+            if (_config.resetsStateOn(toggle, _config.valueString(toggle, valueIndex))) {
+                for (uint32_t j = device.togglesBegin; j < device.togglesBegin + device.togglesCount; j++) {
+                    _toggleStates[j] = _config.toggle(j).initialValue;
+                    _freeformStates.erase(j);
+                }
+            }
+            _toggleStates[i] = valueIndex;
+            _freeformStates.erase(i);
+            changed = true;
+        }
+        if (changed) {
+            exportStates(device.togglesBegin, device.togglesCount);
+        }
+
+        return changed;
+    }
+
     bool DeviceStateManager::asStateDescription(const std::string &deviceName, rapidjson::Document &mqttDescription, rapidjson::Value& root) {
         std::unique_lock<std::mutex> lock(ml);
 
-        auto stateIt = _deviceStates.find(deviceName);
+        int32_t deviceIndex = _config.findDevice(deviceName);
+
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
+            return false;
+        }
+
+        const DeviceConfig& device = _config.device(deviceIndex);
+
+        if (device.togglesCount == 0) {
+            return false;
+        }
+
+        const StringArena& arena = _config.arena();
+        for (uint32_t i = device.togglesBegin; i < device.togglesBegin + device.togglesCount; i++) {
+            ArenaString name = _config.toggle(i).name;
+            rapidjson::Value state;
+            if (_toggleStates[i] == FREEFORM_VALUE) {
+                state.SetString(stateOf(i), mqttDescription.GetAllocator());
+            } else if (_config.toggle(i).numeric) {
+                state.SetInt(_config.rangeValue(_config.toggle(i), _toggleStates[i]));
+            } else {
+                ArenaString value = _config.valueAt(_config.toggle(i), _toggleStates[i]);
+                state = rapidjson::StringRef(arena.c_str(value), value.length);
+            }
+            root.AddMember(rapidjson::StringRef(arena.c_str(name), name.length), state, mqttDescription.GetAllocator());
+        }
+        // Confirms or corrects an earlier pending publish, consumers keep the pending flag otherwise
+        if (_properties.optimisticState) {
+            root.AddMember("pending", false, mqttDescription.GetAllocator());
+        }
+        return true;
+    }
+
+    bool DeviceStateManager::asPendingStateDescription(const std::string &deviceName, const std::vector<std::pair<std::string, std::string>> &targets, rapidjson::Document &mqttDescription, rapidjson::Value &root) {
+        if (!asStateDescription(deviceName, mqttDescription, root)) {
+            return false;
+        }
+
+        // The configuration is immutable, only the toggle states need the lock
+        const DeviceConfig& device = _config.device(_config.findDevice(deviceName));
+        for (const auto& target : targets) {
+            int32_t toggleIndex = _config.findToggle(device, target.first);
+            if (toggleIndex == DeviceConfigTable::NOT_FOUND || !root.HasMember(target.first.c_str())) {
+                return false;
+            }
+
+            const ToggleConfig& toggle = _config.toggle(toggleIndex);
+            rapidjson::Value& state = root[target.first.c_str()];
+            int32_t valueIndex = _config.findValue(toggle, target.second);
+            if (valueIndex == DeviceConfigTable::NOT_FOUND) {
+                state.SetString(target.second, mqttDescription.GetAllocator());
+            } else if (toggle.numeric) {
+                state.SetInt(_config.rangeValue(toggle, valueIndex));
+            } else {
+                ArenaString targetValue = _config.valueAt(toggle, valueIndex);
+                state = rapidjson::StringRef(_config.arena().c_str(targetValue), targetValue.length);
+            }
+        }
+        if (root.HasMember("pending")) {
+            root["pending"].SetBool(true);
+        } else {
+            root.AddMember("pending", true, mqttDescription.GetAllocator());
+        }
+        return true;
+    }
 
-        if (stateIt == _deviceStates.end()) {
+    bool DeviceStateManager::applyStateDescription(const std::string &deviceName, const rapidjson::Value &root) {
+        if (!root.IsObject()) {
+            return false;
+        }
+        // Published before a restart interrupted the sequence, whether it reached the target is unknown
+        if (root.HasMember("pending") && root["pending"].IsBool() && root["pending"].GetBool()) {
+            std::cout << "Ignoring unconfirmed state of " << deviceName << std::endl;
             return false;
         }
 
-        if (stateIt->second._toggles.empty()) {
+        std::unique_lock<std::mutex> lock(ml);
+
+        int32_t deviceIndex = _config.findDevice(deviceName);
+
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
             return false;
         }
 
-        for (const auto& toggle : stateIt->second._toggles) {
-            root.AddMember(rapidjson::StringRef(toggle.second._name), toggle.second._state, mqttDescription.GetAllocator());
+        const DeviceConfig& device = _config.device(deviceIndex);
+        for (auto it = root.MemberBegin(); it != root.MemberEnd(); ++it) {
+            int32_t toggleIndex = _config.findToggle(device, it->name.GetString());
+            if (toggleIndex == DeviceConfigTable::NOT_FOUND) {
+                continue;
+            }
+            if (it->value.IsString()) {
+                assignState(toggleIndex, it->value.GetString());
+            } else if (it->value.IsInt64()) {
+                assignState(toggleIndex, std::to_string(it->value.GetInt64()));
+            }
         }
         return true;
     }
@@ -241,18 +660,21 @@ namespace lm {
     bool DeviceStateManager::asMqttDescription(const std::string& deviceName, rapidjson::Document& mqttDescription, rapidjson::Value& root) {
         std::unique_lock<std::mutex> lock(ml);
 
-        auto stateIt = _deviceStates.find(deviceName);
+        int32_t deviceIndex = _config.findDevice(deviceName);
 
-        if (stateIt == _deviceStates.end()) {
+        if (deviceIndex == DeviceConfigTable::NOT_FOUND) {
             return false;
         }
 
-        auto state = stateIt->second;
+        const DeviceConfig& device = _config.device(deviceIndex);
+        const StringArena& arena = _config.arena();
+        std::string name = arena.str(device.name);
 
         auto& allocator = mqttDescription.GetAllocator();
 
         rapidjson::Value features(rapidjson::kArrayType);
-        for (const auto & _button : state._buttons) {
+        for (uint32_t i = device.buttonsBegin; i < device.buttonsBegin + device.buttonsCount; i++) {
+            std::string _button = arena.str(_config.command(_config.commandList(i)).button);
             rapidjson::Value feature(rapidjson::kObjectType);
             feature.AddMember("access", 7, allocator);
             feature.AddMember("description", "On/off switch " + _button, allocator);
@@ -263,34 +685,46 @@ namespace lm {
             features.GetArray().PushBack(feature, allocator);
         }
 
-        for (const auto & _toggle : state._toggles) {
+        for (uint32_t i = device.togglesBegin; i < device.togglesBegin + device.togglesCount; i++) {
+            const ToggleConfig& _toggle = _config.toggle(i);
+            std::string toggleName = arena.str(_toggle.name);
             rapidjson::Value feature(rapidjson::kObjectType);
             feature.AddMember("access", 7, allocator);
-            feature.AddMember("description", "On/off state " + _toggle.second._name, allocator);
-            feature.AddMember("name", _toggle.second._name, allocator);
-            feature.AddMember("property", _toggle.second._name, allocator);
-            if ("range" == _toggle.second._type) {
+            feature.AddMember("description", "On/off state " + toggleName, allocator);
+            feature.AddMember("name", toggleName, allocator);
+            feature.AddMember("property", toggleName, allocator);
+            if (ToggleType::Range == _toggle.type) {
                 feature.AddMember("type", "numeric", allocator);
-                feature.AddMember("value_min", std::stoi(_toggle.second._values[0]), allocator);
-                feature.AddMember("value_max", std::stoi(_toggle.second._values[1]), allocator);
+                int32_t valueMin, valueMax;
+                if (_config.valueBounds(_toggle, valueMin, valueMax)) {
+                    feature.AddMember("value_min", valueMin, allocator);
+                    feature.AddMember("value_max", valueMax, allocator);
+                }
+                if (_toggle.numeric) {
+                    feature.AddMember("value_step", _toggle.rangeStep, allocator);
+                }
             }
-            if ("switch" == _toggle.second._type) {
+            if (ToggleType::Switch == _toggle.type) {
                 feature.AddMember("type", "binary", allocator);
                 feature.AddMember("value_off", "OFF", allocator);
                 feature.AddMember("value_on", "ON", allocator);
                 //feature["value_toggle"] = "TOGGLE";
             }
-            if ("enum" == _toggle.second._type) {
+            if (ToggleType::Enum == _toggle.type) {
                 feature.AddMember("type", "enum", allocator);
 
                 rapidjson::Value values(rapidjson::kArrayType);
 
-                for (const auto & _value : _toggle.second._values) {
-                    values.GetArray().PushBack(rapidjson::Value(_value, allocator), allocator);
+                for (uint32_t j = 0; j < _toggle.valuesCount; j++) {
+                    ArenaString _value = _config.string(_toggle.valuesBegin + j);
+                    values.GetArray().PushBack(rapidjson::Value(arena.c_str(_value), _value.length, allocator), allocator);
                 }
 
-                for (const auto & _value : _toggle.second._valueToButtonMappings) {
-                    values.GetArray().PushBack(rapidjson::Value(_value.first, allocator), allocator);
+                for (uint32_t j = _toggle.mappingsBegin; j < _toggle.mappingsBegin + _toggle.mappingsCount; j++) {
+                    const ValueButtonMapping& _value = _config.mapping(j);
+                    if (_value.commandsCount > 0) {
+                        values.GetArray().PushBack(rapidjson::Value(arena.c_str(_value.value), _value.value.length, allocator), allocator);
+                    }
                 }
 
                 feature.AddMember("values", values, allocator);
@@ -298,6 +732,24 @@ namespace lm {
             features.GetArray().PushBack(feature, allocator);
         }
 
+        // Macros are actions without state, set only
+        if (device.macrosCount > 0) {
+            rapidjson::Value macroFeature(rapidjson::kObjectType);
+            macroFeature.AddMember("access", 2, allocator);
+            macroFeature.AddMember("description", "Run macro", allocator);
+            macroFeature.AddMember("name", "macro", allocator);
+            macroFeature.AddMember("property", "macro", allocator);
+            macroFeature.AddMember("type", "enum", allocator);
+
+            rapidjson::Value values(rapidjson::kArrayType);
+            for (uint32_t j = device.macrosBegin; j < device.macrosBegin + device.macrosCount; j++) {
+                ArenaString macroName = _config.macro(j).name;
+                values.GetArray().PushBack(rapidjson::Value(arena.c_str(macroName), macroName.length, allocator), allocator);
+            }
+            macroFeature.AddMember("values", values, allocator);
+            features.GetArray().PushBack(macroFeature, allocator);
+        }
+
         rapidjson::Value resetFeature(rapidjson::kObjectType);
         resetFeature.AddMember("access", 7, allocator);
         resetFeature.AddMember("description", "Reset state", allocator);
@@ -313,8 +765,8 @@ namespace lm {
         exposedFeature.AddMember("features", features, allocator);
 
         rapidjson::Value definition(rapidjson::kObjectType);
-        definition.AddMember("description", "IR interface for " + state._name, allocator);
-        definition.AddMember("model", state._name, allocator);
+        definition.AddMember("description", "IR interface for " + name, allocator);
+        definition.AddMember("model", name, allocator);
         definition.AddMember("supports_ota", false, allocator);
         definition.AddMember("vendor", "IR", allocator);
 
@@ -324,8 +776,8 @@ namespace lm {
         exposes.GetArray().PushBack(exposedFeature, allocator);
         definition.AddMember("exposes", exposes, allocator);
 
-        root.AddMember("friendly_name", state._name, allocator);
-        root.AddMember("ieee_address", "ir/" + _properties.serviceName + "/" + state._name, allocator);
+        root.AddMember("friendly_name", name, allocator);
+        root.AddMember("ieee_address", "ir/" + _properties.serviceName + "/" + name, allocator);
         root.AddMember("status", "successful", allocator);
         root.AddMember("supported", true, allocator);
         root.AddMember("definition",  definition, allocator);
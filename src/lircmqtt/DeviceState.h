@@ -7,76 +7,147 @@
 
 #include <string>
 #include <vector>
+#include <utility>
 #include <map>
 #include <memory>
 #include <mutex>
 
 #include "rapidjson/document.h"
+#include "DeviceConfig.h"
+#include "SharedStateExport.h"
 
 namespace lm {
 
-    struct DeviceToggle {
-        std::string _name;
-        std::string _initialState;
-        std::string _state;
-        std::string _type;
-        std::vector<std::string> _values;
-        std::string _button_forward;
-        std::string _button_backwards;
-        bool _wrap_around;
-        std::map<std::string, std::vector<std::string>> _valueToButtonMappings;
-        std::vector<std::string> _reset_state_on;
-    };
-
-    struct DeviceState {
-        std::string _name;
-        std::map<std::string, DeviceToggle> _toggles;
-        std::vector<std::string> _buttons;
-        long _controlIntervalMs;
-    };
-
     struct Properties {
         std::string serviceName;
         std::string discoveryTopic;
         std::string mqttServer;
         std::string deviceTopicPrefix;
-        std::string lircdSocketPath;
+        // Node of this instance in a shared config, empty runs all devices
+        std::string nodeName;
+        // Node running the devices without a "node" tag
+        std::string defaultNode;
+        // All nodes of the shared config, if given devices tagged with another node are reported at load
+        std::vector<std::string> nodes;
+        std::string lircdSocketPath = "/var/run/lirc/lircd";
+        // Track presses of physical remotes received by lircd
+        bool lircdReceive = false;
+        // Minimum gap between two IR frames of any devices on the emitter
+        long emitterGapMs = 0;
+        // SCHED_FIFO priority of the transmit thread, 0 keeps the default scheduling
+        int transmitPriority = 0;
+        // Interval of the airtime stats log, 0 logs them only on SIGUSR1 and at exit
+        long airtimeStatsIntervalMs = 0;
+        // Share of commands to trace, 0 disables tracing
+        double traceSampleRate = 0;
+        size_t traceBufferSpans = 8192;
+        std::string traceFile = "/tmp/lirc-mqtt-trace.json";
+        // Redelivered /set messages within this window are dropped, 0 disables the filter
+        long duplicateWindowMs = 0;
+        // Publish the target state as pending before the IR sequence ran
+        bool optimisticState = false;
+        // Topics kept while disconnected, optionally mirrored to a file to survive restarts
+        size_t outboundBufferTopics = 1024;
+        std::string outboundBufferFile;
+        // POSIX shared memory name (e.g. "/lirc-mqtt-state") for local readers, empty disables the export
+        std::string sharedStateName;
     };
 
+    inline std::string clientId(const Properties& properties) {
+        return properties.nodeName.empty() ? properties.serviceName : properties.serviceName + "-" + properties.nodeName;
+    }
+
     class DeviceStateManager {
     private:
         std::mutex ml;
         Properties _properties;
-        std::map<std::string, DeviceState> _deviceStates;
+        DeviceConfigTable _config;
+        // Current value index per toggle, indexed like the toggles of _config
+        std::vector<int32_t> _toggleStates;
+        // Values not part of the toggle config, referenced by FREEFORM_VALUE
+        std::map<uint32_t, std::string> _freeformStates;
+        std::unique_ptr<SharedStateExport> _sharedState;
+
+        static const int32_t FREEFORM_VALUE = -1;
+
+        std::string stateOf(uint32_t toggleIndex) const;
+        void assignState(uint32_t toggleIndex, const std::string& value);
+        bool isLocal(const DeviceConfig& device) const {
+            if (_properties.nodeName.empty()) {
+                return true;
+            }
+            const std::string& node = device.node.length == 0 ? _properties.defaultNode : _config.arena().str(device.node);
+            return node == _properties.nodeName;
+        }
 
-        bool moveToStateUpDown(const std::string& value, DeviceToggle &toggleIt, std::vector<std::string> &rtnButton, int &rtnNumInvoke) const;
-        bool moveToButtonValueMapping(const std::string& value, DeviceToggle &toggle, std::vector<std::string> &rtnButton, int &rtnNumInvoke) const;
+        // Publishes changed toggle states to the shared memory export, if enabled
+        void exportStates(uint32_t begin, uint32_t count);
+
+        bool moveToStateUpDown(const std::string& value, uint32_t toggleIndex, std::vector<uint32_t> &rtnCommands, int &rtnNumInvoke) const;
+        bool planUpDown(const std::string& value, uint32_t toggleIndex, uint32_t& rtnCommand, int32_t& rtnCurrentValue, int& rtnDirection, int& rtnNumInvoke) const;
+        bool moveToButtonValueMapping(const std::string& value, const ToggleConfig &toggle, std::vector<uint32_t> &rtnCommands, int &rtnNumInvoke) const;
 
     public:
         explicit DeviceStateManager(Properties properties);
 
         void addDeviceState(const rapidjson::Value& json);
 
-        bool moveToState(const std::string& deviceName, const std::string& toggleName, const std::string& value, std::vector<std::string>& rtnButton, int& rtnNumInvokes, bool& rtnResetState, long& rtnControlIntervalMs);
+        // Commands index DeviceConfigTable::command(), static buttons are pressed once for any value.
+        // Delay toggles plan no commands but a pause of rtnDelayMs
+        bool moveToState(const std::string& deviceName, const std::string& toggleName, const std::string& value, std::vector<uint32_t>& rtnCommands, int& rtnNumInvokes, bool& rtnResetState, long& rtnControlIntervalMs, long& rtnHoldMs, long& rtnDelayMs);
+        // State reached after the first numInvokesDone invokes of the moveToState sequence towards value
+        bool intermediateState(const std::string& deviceName, const std::string& toggleName, const std::string& value, int numInvokesDone, std::string& rtnValue);
+        // Toggle states reached after the first stepsDone steps of the macro's timeline, returns true if any changed
+        bool applyMacro(const std::string& deviceName, uint32_t macroIndex, uint32_t stepsDone);
         bool setState(const std::string& deviceName, const std::string& toggleName, const std::string& value);
         bool resetDeviceState(const std::string& deviceName);
+        // Follows a button press received from a physical remote, returns true if the state changed
+        bool applyReceivedButton(const std::string& deviceName, const std::string& button);
 
         bool asMqttDescription(const std::string& deviceName, rapidjson::Document& mqttDescription, rapidjson::Value& root);
 
+        // With optimisticState the description carries "pending": false
         bool asStateDescription(const std::string& deviceName, rapidjson::Document& mqttDescription, rapidjson::Value& root);
 
+        // State description with the toggles already at the target values, tagged "pending" until the sequences completed
+        bool asPendingStateDescription(const std::string& deviceName, const std::vector<std::pair<std::string, std::string>>& targets, rapidjson::Document& mqttDescription, rapidjson::Value& root);
+
+        // Inverse of asStateDescription, e.g. for states buffered before a restart
+        bool applyStateDescription(const std::string& deviceName, const rapidjson::Value& root);
+
         const Properties& getProperties() {
             return _properties;
         }
 
+        // Immutable once the configuration is sealed, no locking required
+        const DeviceConfigTable& getConfiguration() const {
+            return _config;
+        }
+
         std::vector<std::string> getDeviceNames() {
             std::vector<std::string> names;
-            for (const auto & deviceState : _deviceStates) {
-                names.push_back(deviceState.first);
+            for (auto deviceIndex : _config.devicesByName()) {
+                names.push_back(_config.arena().str(_config.device(deviceIndex).name));
             }
             return names;
         }
 
+        // Devices whose emitter is owned by this node
+        std::vector<std::string> getLocalDeviceNames() {
+            std::vector<std::string> names;
+            for (auto deviceIndex : _config.devicesByName()) {
+                const DeviceConfig& device = _config.device(deviceIndex);
+                if (isLocal(device)) {
+                    names.push_back(_config.arena().str(device.name));
+                }
+            }
+            return names;
+        }
+
+        // Called once all devices are added, the configuration is immutable afterwards
+        void sealConfiguration();
+
+        size_t memoryUsage();
 
         };
 
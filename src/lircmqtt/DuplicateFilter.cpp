@@ -0,0 +1,66 @@
+#include "DuplicateFilter.h"
+
+namespace lm {
+
+    const size_t DuplicateFilter::SLOTS;
+    const size_t DuplicateFilter::MAX_PROBES;
+
+    uint64_t DuplicateFilter::hash(const TransportMessage &message) {
+        // FNV-1a over topic, a separator, payload and packet id
+        uint64_t h = 14695981039346656037ULL;
+        auto mix = [&h](unsigned char c) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        };
+        for (char c : message.topic) {
+            mix(static_cast<unsigned char>(c));
+        }
+        mix(0);
+        for (char c : message.payload) {
+            mix(static_cast<unsigned char>(c));
+        }
+        mix(static_cast<unsigned char>(message.packetId & 0xff));
+        mix(static_cast<unsigned char>(message.packetId >> 8));
+        // 0 marks an empty slot
+        return h == 0 ? 1 : h;
+    }
+
+    bool DuplicateFilter::isDuplicate(const TransportMessage &message) {
+        if (_ttl.count() <= 0) {
+            return false;
+        }
+
+        auto now = Clock::now();
+        uint64_t key = hash(message);
+        size_t start = static_cast<size_t>(key) & (SLOTS - 1);
+
+        for (size_t i = 0; i < MAX_PROBES; i++) {
+            Slot& slot = _slots[(start + i) & (SLOTS - 1)];
+            if (slot.key != key) {
+                continue;
+            }
+            bool seen = slot.expires > now;
+            slot.expires = now + _ttl;
+            // Without DUP flag or packet id a repetition may be intended, e.g. pressing a button twice
+            if (seen && (message.duplicate || message.packetId != 0)) {
+                _suppressed++;
+                return true;
+            }
+            return false;
+        }
+
+        // New key, takes the first free or expired slot, else the one expiring first
+        Slot* victim = &_slots[start];
+        for (size_t i = 0; i < MAX_PROBES && victim->expires > now; i++) {
+            Slot& slot = _slots[(start + i) & (SLOTS - 1)];
+            if (slot.expires < victim->expires) {
+                victim = &slot;
+            }
+        }
+
+        victim->key = key;
+        victim->expires = now + _ttl;
+        return false;
+    }
+
+} // lm
@@ -0,0 +1,52 @@
+#ifndef LIRC_MQTT_DUPLICATEFILTER_H
+#define LIRC_MQTT_DUPLICATEFILTER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "Transport.h"
+
+namespace lm {
+
+    /**
+     * Fixed-memory filter for QoS 1 messages the broker delivers again, e.g. after
+     * a reconnect. Messages are keyed by a hash of topic, payload and packet id and
+     * remembered for a time-to-live. A message seen before is only dropped if it
+     * can be told apart from a legitimate repetition: it carries the DUP flag or a
+     * packet id. Not thread-safe, meant for the transport's delivery thread.
+     */
+    class DuplicateFilter {
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Slot {
+            uint64_t key = 0;
+            Clock::time_point expires;
+        };
+
+        static const size_t SLOTS = 1024;
+        static const size_t MAX_PROBES = 8;
+
+        std::chrono::milliseconds _ttl;
+        std::array<Slot, SLOTS> _slots;
+        std::atomic<uint64_t> _suppressed{0};
+
+        static uint64_t hash(const TransportMessage& message);
+
+    public:
+        // A ttl of 0 disables the filter
+        explicit DuplicateFilter(long ttlMs) : _ttl(ttlMs) {}
+
+        // Records the message, returns true if it is a duplicate to be dropped
+        bool isDuplicate(const TransportMessage& message);
+
+        uint64_t suppressed() const {
+            return _suppressed;
+        }
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_DUPLICATEFILTER_H
@@ -0,0 +1,143 @@
+#include "LircConnection.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <lirc_client.h>
+
+namespace lm {
+
+    const int LircConnection::REPLY_TIMEOUT_MS;
+
+    LircConnection::LircConnection(std::string socketPath) : _socketPath(std::move(socketPath)) {}
+
+    LircConnection::~LircConnection() {
+        disconnect();
+    }
+
+    bool LircConnection::connect() {
+        _fd = lirc_get_local_socket(_socketPath.c_str(), 0);
+        if (_fd < 0) {
+            std::cout << "Error initializing Lirc" << std::endl;
+            _fd = -1;
+            return false;
+        }
+        _buffer.clear();
+        return true;
+    }
+
+    void LircConnection::disconnect() {
+        if (_fd >= 0) {
+            close(_fd);
+            _fd = -1;
+        }
+        _buffer.clear();
+    }
+
+    bool LircConnection::send(const char *command, size_t length) {
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (_fd < 0 && !connect()) {
+                return false;
+            }
+
+            _timedOut = false;
+            ssize_t written;
+            do {
+                written = ::send(_fd, command, length, MSG_NOSIGNAL);
+            } while (written < 0 && errno == EINTR);
+
+            if (written == static_cast<ssize_t>(length)) {
+                bool success;
+                if (readReply(command, length, success)) {
+                    if (!success) {
+                        std::cout << "Error sending Lirc control" << std::endl;
+                    }
+                    return success;
+                }
+                // lircd may have sent the command before the reply got lost, sending it again could press twice
+                disconnect();
+                if (_timedOut) {
+                    std::cout << "Error sending Lirc control, no reply from lircd" << std::endl;
+                } else {
+                    std::cout << "Error sending Lirc control, lircd connection lost before its reply" << std::endl;
+                }
+                return false;
+            }
+
+            // lircd restarted or the connection broke otherwise, it did not see the command
+            disconnect();
+        }
+        std::cout << "Error sending Lirc control, lircd connection lost" << std::endl;
+        return false;
+    }
+
+    bool LircConnection::readLine(std::string &rtnLine, std::chrono::steady_clock::time_point deadline) {
+        for (;;) {
+            auto newline = _buffer.find('\n');
+            if (newline != std::string::npos) {
+                rtnLine.assign(_buffer, 0, newline);
+                _buffer.erase(0, newline + 1);
+                return true;
+            }
+
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) {
+                _timedOut = true;
+                return false;
+            }
+            pollfd pfd{};
+            pfd.fd = _fd;
+            pfd.events = POLLIN;
+            int ready = poll(&pfd, 1, static_cast<int>(remaining.count()));
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready == 0) {
+                _timedOut = true;
+                return false;
+            }
+            if (ready < 0) {
+                return false;
+            }
+
+            char chunk[256];
+            ssize_t received = read(_fd, chunk, sizeof(chunk));
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            _buffer.append(chunk, static_cast<size_t>(received));
+        }
+    }
+
+    bool LircConnection::readReply(const char *command, size_t length, bool &rtnSuccess) {
+        // BEGIN, the command echoed, SUCCESS or ERROR, optional DATA, END
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REPLY_TIMEOUT_MS);
+        std::string line;
+        bool inReply = false;
+        bool echoed = false;
+        rtnSuccess = false;
+
+        while (readLine(line, deadline)) {
+            if (!inReply) {
+                inReply = line == "BEGIN";
+            } else if (!echoed) {
+                // Another packet, e.g. the SIGHUP notification
+                echoed = line.length() + 1 == length && line.compare(0, line.length(), command, length - 1) == 0;
+                inReply = echoed;
+            } else if (line == "SUCCESS") {
+                rtnSuccess = true;
+            } else if (line == "END") {
+                return true;
+            }
+        }
+        return false;
+    }
+
+} // lm
@@ -0,0 +1,49 @@
+#ifndef LIRC_MQTT_LIRCCONNECTION_H
+#define LIRC_MQTT_LIRCCONNECTION_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace lm {
+
+    /**
+     * Persistent connection to the lircd socket for sending. Commands are written
+     * as complete protocol lines with a single write, the reply is parsed from the
+     * stream (skipping button broadcasts lircd sends to every client).
+     */
+    class LircConnection {
+    private:
+        static const int REPLY_TIMEOUT_MS = 5000;
+
+        std::string _socketPath;
+        int _fd = -1;
+        // Received bytes not yet consumed as a line
+        std::string _buffer;
+        // lircd did not answer in time, the command may have been sent
+        bool _timedOut = false;
+
+        bool connect();
+        void disconnect();
+        bool readLine(std::string& rtnLine, std::chrono::steady_clock::time_point deadline);
+        // Returns false if the connection broke, rtnSuccess is lircd's verdict
+        bool readReply(const char* command, size_t length, bool& rtnSuccess);
+
+    public:
+        explicit LircConnection(std::string socketPath);
+        ~LircConnection();
+
+        LircConnection(const LircConnection&) = delete;
+        LircConnection& operator=(const LircConnection&) = delete;
+
+        // command is a full line including "\n", it is written again only if a broken connection rejected the write
+        bool send(const char* command, size_t length);
+
+        bool send(const std::string& command) {
+            return send(command.data(), command.length());
+        }
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_LIRCCONNECTION_H
@@ -0,0 +1,141 @@
+#include "LircReceiver.h"
+
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <lirc_client.h>
+
+namespace lm {
+
+    static const int RECONNECT_INTERVAL_MS = 2000;
+
+    LircReceiver::LircReceiver(std::string lircdSocketPath, Handler handler) :
+        _lircdSocketPath(std::move(lircdSocketPath)), _handler(std::move(handler)) {
+        _epollFd = epoll_create1(EPOLL_CLOEXEC);
+        _stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = _stopFd;
+        epoll_ctl(_epollFd, EPOLL_CTL_ADD, _stopFd, &event);
+    }
+
+    LircReceiver::~LircReceiver() {
+        if (_thread.joinable()) {
+            uint64_t one = 1;
+            if (write(_stopFd, &one, sizeof(one)) != sizeof(one)) {
+                std::cerr << "Error stopping Lirc receiver" << std::endl;
+            }
+            _thread.join();
+        }
+        disconnectLircd();
+        close(_stopFd);
+        close(_epollFd);
+    }
+
+    void LircReceiver::start() {
+        _thread = std::thread(&LircReceiver::run, this);
+    }
+
+    bool LircReceiver::connectLircd() {
+        int fd = lirc_get_local_socket(_lircdSocketPath.c_str(), 1);
+        if (fd < 0) {
+            return false;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            return false;
+        }
+
+        _lircdFd = fd;
+        _buffer.clear();
+        std::cout << "Receiving IR codes from " << _lircdSocketPath << std::endl;
+        return true;
+    }
+
+    void LircReceiver::disconnectLircd() {
+        if (_lircdFd >= 0) {
+            epoll_ctl(_epollFd, EPOLL_CTL_DEL, _lircdFd, nullptr);
+            close(_lircdFd);
+            _lircdFd = -1;
+        }
+    }
+
+    void LircReceiver::run() {
+        epoll_event events[2];
+        for (;;) {
+            if (_lircdFd < 0 && !connectLircd()) {
+                std::cout << "Error connecting Lirc receiver to " << _lircdSocketPath << ", retrying" << std::endl;
+            }
+
+            int n = epoll_wait(_epollFd, events, 2, _lircdFd < 0 ? RECONNECT_INTERVAL_MS : -1);
+            if (n < 0 && errno != EINTR) {
+                std::cerr << "Error waiting for IR codes" << std::endl;
+                return;
+            }
+
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.fd == _stopFd) {
+                    return;
+                }
+                if (events[i].data.fd == _lircdFd && !readLircd()) {
+                    std::cout << "Lirc receiver lost connection to " << _lircdSocketPath << std::endl;
+                    disconnectLircd();
+                }
+            }
+        }
+    }
+
+    bool LircReceiver::readLircd() {
+        char readBuffer[4096];
+        for (;;) {
+            ssize_t length = read(_lircdFd, readBuffer, sizeof(readBuffer));
+            if (length == 0) {
+                return false;
+            }
+            if (length < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+
+            auto received = std::chrono::steady_clock::now();
+            _buffer.append(readBuffer, static_cast<size_t>(length));
+
+            size_t lineStart = 0;
+            size_t lineEnd;
+            while ((lineEnd = _buffer.find('\n', lineStart)) != std::string::npos) {
+                processLine(_buffer.substr(lineStart, lineEnd - lineStart), received);
+                lineStart = lineEnd + 1;
+            }
+            _buffer.erase(0, lineStart);
+        }
+    }
+
+    void LircReceiver::processLine(const std::string &line, std::chrono::steady_clock::time_point received) {
+        // <code> <repeat count> <button> <remote>, anything else (e.g. SIGHUP packets) is ignored
+        std::istringstream fields(line);
+        std::string code;
+        unsigned repeat;
+        std::string button;
+        std::string remote;
+        if (!(fields >> code >> std::hex >> repeat >> button >> remote)) {
+            return;
+        }
+
+        if (repeat > 0) {
+            return;
+        }
+
+        _handler(remote, button, received);
+    }
+
+} // lm
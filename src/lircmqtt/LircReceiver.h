@@ -0,0 +1,49 @@
+#ifndef LIRC_MQTT_LIRCRECEIVER_H
+#define LIRC_MQTT_LIRCRECEIVER_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace lm {
+
+    /**
+     * Receives the codes lircd decodes from physical remotes, like lirc_nextcode
+     * but event driven: a single thread sleeps in epoll_wait until lircd sends a
+     * code line or the receiver is stopped. Key repeats of a held button are
+     * collapsed, the handler only sees the initial press.
+     */
+    class LircReceiver {
+    public:
+        typedef std::function<void(const std::string& remote, const std::string& button, std::chrono::steady_clock::time_point received)> Handler;
+
+    private:
+        std::string _lircdSocketPath;
+        Handler _handler;
+        int _epollFd = -1;
+        int _stopFd = -1;
+        int _lircdFd = -1;
+        std::string _buffer;
+        std::thread _thread;
+
+        void run();
+        bool connectLircd();
+        void disconnectLircd();
+        // Returns false once lircd closed the connection
+        bool readLircd();
+        void processLine(const std::string& line, std::chrono::steady_clock::time_point received);
+
+    public:
+        LircReceiver(std::string lircdSocketPath, Handler handler);
+        ~LircReceiver();
+
+        LircReceiver(const LircReceiver&) = delete;
+        LircReceiver& operator=(const LircReceiver&) = delete;
+
+        void start();
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_LIRCRECEIVER_H
@@ -0,0 +1,258 @@
+// Drives the bridge through the in-process loopback broker against a fake lircd:
+// measures /set message -> IR frame -> state publish latency, then drops the
+// bridge's connection with lost acks to check redelivered messages are not sent twice.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "rapidjson/document.h"
+#include "DeviceState.h"
+#include "LoopbackBroker.h"
+#include "MqttConsumer.h"
+#include "Tracer.h"
+
+using namespace std::chrono;
+
+namespace {
+
+    const char* DEVICE_CONFIG = R"({
+        "deviceName": "bench",
+        "buttons": ["POWER"],
+        "toggles": [{
+            "name": "input",
+            "type": "enum",
+            "valueButtonMappings": [
+                {"value": "HDMI1", "button": "KEY_1"},
+                {"value": "HDMI2", "button": "KEY_2"}
+            ]
+        }]
+    })";
+
+    /**
+     * Answers every command like lircd does and records when its line arrived.
+     */
+    class FakeLircd {
+    private:
+        std::string _path;
+        int _listenFd;
+        std::thread _thread;
+        std::mutex _sync;
+        std::condition_variable _cvFrame;
+        std::vector<steady_clock::time_point> _frames;
+
+        void run() {
+            for (;;) {
+                int fd = accept(_listenFd, nullptr, nullptr);
+                if (fd < 0) {
+                    return;
+                }
+                std::string buffer;
+                char chunk[256];
+                ssize_t received;
+                while ((received = read(fd, chunk, sizeof(chunk))) > 0) {
+                    buffer.append(chunk, static_cast<size_t>(received));
+                    size_t newline;
+                    while ((newline = buffer.find('\n')) != std::string::npos) {
+                        std::string line = buffer.substr(0, newline);
+                        buffer.erase(0, newline + 1);
+                        {
+                            std::unique_lock<std::mutex> lock(_sync);
+                            _frames.push_back(steady_clock::now());
+                        }
+                        _cvFrame.notify_all();
+                        std::string reply = "BEGIN\n" + line + "\nSUCCESS\nEND\n";
+                        if (write(fd, reply.data(), reply.size()) < 0) {
+                            break;
+                        }
+                    }
+                }
+                close(fd);
+            }
+        }
+
+    public:
+        explicit FakeLircd(std::string path) : _path(std::move(path)) {
+            unlink(_path.c_str());
+            _listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            std::strncpy(address.sun_path, _path.c_str(), sizeof(address.sun_path) - 1);
+            if (bind(_listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(_listenFd, 4) != 0) {
+                std::cerr << "Error listening on " << _path << std::endl;
+                std::exit(1);
+            }
+            _thread = std::thread(&FakeLircd::run, this);
+        }
+
+        ~FakeLircd() {
+            shutdown(_listenFd, SHUT_RDWR);
+            close(_listenFd);
+            _thread.detach();
+            unlink(_path.c_str());
+        }
+
+        size_t frameCount() {
+            std::unique_lock<std::mutex> lock(_sync);
+            return _frames.size();
+        }
+
+        bool waitForFrame(size_t index, steady_clock::time_point& rtnTime) {
+            std::unique_lock<std::mutex> lock(_sync);
+            if (!_cvFrame.wait_for(lock, seconds(5), [this, index] { return _frames.size() > index; })) {
+                return false;
+            }
+            rtnTime = _frames[index];
+            return true;
+        }
+    };
+
+    /**
+     * Client on the bench side, publishes /set messages and records state publishes.
+     */
+    class BenchClient : public lm::TransportHandler {
+    private:
+        std::mutex _sync;
+        std::condition_variable _cvState;
+        std::vector<steady_clock::time_point> _states;
+
+    public:
+        void connected() override {}
+
+        void connectionLost(const std::string& cause) override {}
+
+        void messageArrived(const lm::TransportMessage& message) override {
+            {
+                std::unique_lock<std::mutex> lock(_sync);
+                _states.push_back(steady_clock::now());
+            }
+            _cvState.notify_all();
+        }
+
+        size_t stateCount() {
+            std::unique_lock<std::mutex> lock(_sync);
+            return _states.size();
+        }
+
+        bool waitForState(size_t index, steady_clock::time_point& rtnTime) {
+            std::unique_lock<std::mutex> lock(_sync);
+            if (!_cvState.wait_for(lock, seconds(5), [this, index] { return _states.size() > index; })) {
+                return false;
+            }
+            rtnTime = _states[index];
+            return true;
+        }
+    };
+
+    void printLatencies(const std::string& name, std::vector<long>& latenciesUs) {
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+        std::cout << name << ": p50 " << latenciesUs[latenciesUs.size() / 2] << "us"
+                  << ", p99 " << latenciesUs[latenciesUs.size() * 99 / 100] << "us"
+                  << ", max " << latenciesUs.back() << "us" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 1000;
+    if (iterations <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [iterations]" << std::endl;
+        return 1;
+    }
+
+    lm::Properties properties;
+    properties.serviceName = "lirc-mqtt-bench";
+    properties.discoveryTopic = "bench/discovery";
+    properties.mqttServer = lm::LOOPBACK_SCHEME + "bench";
+    properties.deviceTopicPrefix = "bench/";
+    properties.lircdSocketPath = "/tmp/lirc-mqtt-bench-" + std::to_string(getpid()) + ".sock";
+    properties.duplicateWindowMs = 60000;
+
+    FakeLircd lircd(properties.lircdSocketPath);
+
+    auto deviceStateManager = std::make_shared<lm::DeviceStateManager>(properties);
+    rapidjson::Document deviceJson;
+    deviceJson.Parse(DEVICE_CONFIG);
+    deviceStateManager->addDeviceState(deviceJson);
+    deviceStateManager->sealConfiguration();
+    auto tracer = std::make_shared<lm::Tracer>(0, 0, "");
+
+    auto broker = lm::LoopbackBroker::get("bench");
+    std::string bridgeId = lm::clientId(properties);
+    lm::LoopbackTransport bridgeTransport(broker, bridgeId, false);
+    lm::LoopbackTransport clientTransport(broker, "bench-client", true);
+
+    BenchClient client;
+    clientTransport.setHandler(&client);
+    clientTransport.connect();
+    clientTransport.subscribe(properties.deviceTopicPrefix + "bench", lm::QOS);
+
+    const std::string setTopic = properties.deviceTopicPrefix + "bench/set";
+    int failures = 0;
+    {
+        lm::callback bridge(bridgeTransport, deviceStateManager, tracer);
+        bridgeTransport.setHandler(&bridge);
+        bridgeTransport.connect();
+
+        // The state published on connect
+        steady_clock::time_point received;
+        if (!client.waitForState(0, received)) {
+            std::cerr << "Bridge did not publish its initial state" << std::endl;
+            return 1;
+        }
+
+        std::vector<long> irLatenciesUs;
+        std::vector<long> stateLatenciesUs;
+        for (int i = 0; i < iterations; i++) {
+            size_t frame = lircd.frameCount();
+            size_t state = client.stateCount();
+            auto sent = steady_clock::now();
+            clientTransport.publish(setTopic, i % 2 == 0 ? R"({"input": "HDMI2"})" : R"({"input": "HDMI1"})", lm::QOS, false);
+
+            steady_clock::time_point ir, published;
+            if (!lircd.waitForFrame(frame, ir) || !client.waitForState(state, published)) {
+                std::cerr << "Timeout in iteration " << i << std::endl;
+                return 1;
+            }
+            irLatenciesUs.push_back(duration_cast<microseconds>(ir - sent).count());
+            stateLatenciesUs.push_back(duration_cast<microseconds>(published - sent).count());
+        }
+        printLatencies("message -> IR frame", irLatenciesUs);
+        printLatencies("message -> state publish", stateLatenciesUs);
+
+        // Acks of the last presses get lost, the broker delivers them again with DUP
+        const int presses = 10;
+        const size_t lostAcks = 5;
+        size_t framesBefore = lircd.frameCount();
+        for (int i = 0; i < presses; i++) {
+            clientTransport.publish(setTopic, R"({"POWER": "TOGGLE"})", lm::QOS, false);
+        }
+        steady_clock::time_point ir;
+        if (!lircd.waitForFrame(framesBefore + presses - 1, ir)) {
+            std::cerr << "Timeout waiting for presses" << std::endl;
+            return 1;
+        }
+        broker->dropConnection(bridgeId, "bench", lostAcks);
+        broker->reconnect(bridgeId);
+        std::this_thread::sleep_for(milliseconds(500));
+
+        size_t extraFrames = lircd.frameCount() - framesBefore - presses;
+        std::cout << "Redelivered " << lostAcks << " of " << presses << " presses, " << extraFrames << " sent twice" << std::endl;
+        if (extraFrames != 0) {
+            failures++;
+        }
+
+        bridgeTransport.disconnect();
+    }
+    clientTransport.disconnect();
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,322 @@
+#include "LoopbackBroker.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace lm {
+
+    const size_t LoopbackBroker::MAX_OFFLINE_MESSAGES;
+    const size_t LoopbackBroker::MAX_ACKED_MESSAGES;
+
+    LoopbackBroker::LoopbackBroker() {
+        _thread = std::thread(&LoopbackBroker::run, this);
+    }
+
+    LoopbackBroker::~LoopbackBroker() {
+        {
+            std::unique_lock<std::mutex> lock(_sync);
+            _bShutdown = true;
+        }
+        _cvEvent.notify_all();
+        _thread.join();
+    }
+
+    std::shared_ptr<LoopbackBroker> LoopbackBroker::get(const std::string &name) {
+        static std::mutex brokersSync;
+        static std::map<std::string, std::weak_ptr<LoopbackBroker>> brokers;
+
+        std::unique_lock<std::mutex> lock(brokersSync);
+        auto broker = brokers[name].lock();
+        if (!broker) {
+            broker = std::make_shared<LoopbackBroker>();
+            brokers[name] = broker;
+        }
+        return broker;
+    }
+
+    bool LoopbackBroker::topicMatches(const std::string &topicFilter, const std::string &topic) {
+        // Wildcards at the first level do not match system topics
+        if (!topic.empty() && topic[0] == '$' && !topicFilter.empty() && (topicFilter[0] == '+' || topicFilter[0] == '#')) {
+            return false;
+        }
+
+        size_t filterPos = 0;
+        size_t topicPos = 0;
+        for (;;) {
+            size_t filterEnd = topicFilter.find('/', filterPos);
+            std::string filterLevel = topicFilter.substr(filterPos, filterEnd == std::string::npos ? std::string::npos : filterEnd - filterPos);
+
+            // # also matches the parent level, "a/#" matches "a"
+            if (filterLevel == "#") {
+                return true;
+            }
+            if (topicPos == std::string::npos) {
+                return false;
+            }
+
+            size_t topicEnd = topic.find('/', topicPos);
+            if (filterLevel != "+" && topic.compare(topicPos, topicEnd == std::string::npos ? std::string::npos : topicEnd - topicPos, filterLevel) != 0) {
+                return false;
+            }
+
+            if (filterEnd == std::string::npos) {
+                return topicEnd == std::string::npos;
+            }
+            filterPos = filterEnd + 1;
+            topicPos = topicEnd == std::string::npos ? std::string::npos : topicEnd + 1;
+        }
+    }
+
+    void LoopbackBroker::connect(const std::string &clientId, LoopbackTransport *client, bool cleanSession) {
+        std::unique_lock<std::mutex> lock(_sync);
+        Session& session = _sessions[clientId];
+        if (cleanSession) {
+            session = Session();
+        }
+        session.client = client;
+        session.cleanSession = cleanSession;
+        session.online = true;
+        session.connection++;
+        session.acked.clear();
+
+        _events.push_back(Event{clientId, EventType::Connected, TransportMessage()});
+        for (auto& message : session.unacked) {
+            message.duplicate = true;
+            _events.push_back(Event{clientId, EventType::Message, std::move(message)});
+        }
+        session.unacked.clear();
+        for (auto& message : session.offlineQueue) {
+            _events.push_back(Event{clientId, EventType::Message, std::move(message)});
+        }
+        session.offlineQueue.clear();
+        _cvEvent.notify_one();
+    }
+
+    void LoopbackBroker::disconnect(const std::string &clientId) {
+        std::unique_lock<std::mutex> lock(_sync);
+        waitUntilNotDelivering(lock, clientId);
+
+        auto sessionIt = _sessions.find(clientId);
+        if (sessionIt == _sessions.end()) {
+            return;
+        }
+        if (sessionIt->second.cleanSession) {
+            _sessions.erase(sessionIt);
+        } else {
+            sessionIt->second.client = nullptr;
+            sessionIt->second.online = false;
+        }
+    }
+
+    void LoopbackBroker::dropConnection(const std::string &clientId, const std::string &cause, size_t lostAcks) {
+        std::unique_lock<std::mutex> lock(_sync);
+        auto sessionIt = _sessions.find(clientId);
+        if (sessionIt == _sessions.end() || !sessionIt->second.online) {
+            return;
+        }
+        Session& session = sessionIt->second;
+        session.online = false;
+
+        if (!session.cleanSession) {
+            lostAcks = std::min(lostAcks, session.acked.size());
+            session.unacked.insert(session.unacked.end(), session.acked.end() - static_cast<std::ptrdiff_t>(lostAcks), session.acked.end());
+        }
+        session.acked.clear();
+
+        TransportMessage reason;
+        reason.payload = cause;
+        _events.push_back(Event{clientId, EventType::ConnectionLost, reason});
+        _cvEvent.notify_one();
+    }
+
+    bool LoopbackBroker::reconnect(const std::string &clientId) {
+        LoopbackTransport* client;
+        bool cleanSession;
+        {
+            std::unique_lock<std::mutex> lock(_sync);
+            auto sessionIt = _sessions.find(clientId);
+            if (sessionIt == _sessions.end() || sessionIt->second.online || sessionIt->second.client == nullptr) {
+                return false;
+            }
+            client = sessionIt->second.client;
+            cleanSession = sessionIt->second.cleanSession;
+        }
+        connect(clientId, client, cleanSession);
+        return true;
+    }
+
+    bool LoopbackBroker::subscribe(const std::string &clientId, const std::string &topicFilter, int qos) {
+        std::unique_lock<std::mutex> lock(_sync);
+        auto sessionIt = _sessions.find(clientId);
+        if (sessionIt == _sessions.end() || !sessionIt->second.online) {
+            return false;
+        }
+        sessionIt->second.subscriptions[topicFilter] = qos;
+
+        for (const auto& retained : _retained) {
+            if (topicMatches(topicFilter, retained.first)) {
+                enqueueMessage(clientId, sessionIt->second, retained.second, std::min(qos, retained.second.qos));
+            }
+        }
+        _cvEvent.notify_one();
+        return true;
+    }
+
+    bool LoopbackBroker::publish(const std::string &clientId, const TransportMessage &message) {
+        std::unique_lock<std::mutex> lock(_sync);
+        auto senderIt = _sessions.find(clientId);
+        if (senderIt == _sessions.end() || !senderIt->second.online) {
+            return false;
+        }
+
+        if (message.retained) {
+            if (message.payload.empty()) {
+                _retained.erase(message.topic);
+            } else {
+                _retained[message.topic] = message;
+            }
+        }
+
+        TransportMessage delivery = message;
+        delivery.retained = false;
+        delivery.duplicate = false;
+        for (auto& session : _sessions) {
+            int qos = -1;
+            for (const auto& subscription : session.second.subscriptions) {
+                if (topicMatches(subscription.first, message.topic)) {
+                    qos = std::max(qos, subscription.second);
+                }
+            }
+            if (qos >= 0) {
+                enqueueMessage(session.first, session.second, delivery, std::min(qos, message.qos));
+            }
+        }
+        _cvEvent.notify_one();
+        return true;
+    }
+
+    void LoopbackBroker::enqueueMessage(const std::string &clientId, Session &session, TransportMessage message, int qos) {
+        message.qos = qos;
+        message.packetId = 0;
+        if (qos > 0) {
+            if (++session.nextPacketId == 0) {
+                session.nextPacketId = 1;
+            }
+            message.packetId = session.nextPacketId;
+        }
+
+        if (session.online) {
+            _events.push_back(Event{clientId, EventType::Message, std::move(message)});
+        } else if (qos > 0 && !session.cleanSession) {
+            session.offlineQueue.push_back(std::move(message));
+            if (session.offlineQueue.size() > MAX_OFFLINE_MESSAGES) {
+                session.offlineQueue.pop_front();
+            }
+        }
+    }
+
+    void LoopbackBroker::waitUntilNotDelivering(std::unique_lock<std::mutex> &lock, const std::string &clientId) {
+        // Handlers may disconnect themselves from the broker thread
+        if (std::this_thread::get_id() == _thread.get_id()) {
+            return;
+        }
+        _cvDelivered.wait(lock, [this, &clientId] { return _delivering != clientId; });
+    }
+
+    void LoopbackBroker::run() {
+        std::unique_lock<std::mutex> lock(_sync);
+        for (;;) {
+            _cvEvent.wait(lock, [this] { return _bShutdown || !_events.empty(); });
+            if (_events.empty()) {
+                return;
+            }
+
+            Event event = std::move(_events.front());
+            _events.pop_front();
+
+            auto sessionIt = _sessions.find(event.clientId);
+            if (sessionIt == _sessions.end() || sessionIt->second.client == nullptr) {
+                continue;
+            }
+            Session& session = sessionIt->second;
+            if (event.type == EventType::Message && !session.online) {
+                // Connection dropped after the message was queued
+                if (event.message.qos > 0 && !session.cleanSession) {
+                    session.offlineQueue.push_back(std::move(event.message));
+                }
+                continue;
+            }
+
+            TransportHandler* handler = session.client->_handler;
+            if (handler == nullptr) {
+                continue;
+            }
+
+            uint64_t connection = session.connection;
+            _delivering = event.clientId;
+            lock.unlock();
+            switch (event.type) {
+                case EventType::Connected:
+                    handler->connected();
+                    break;
+                case EventType::ConnectionLost:
+                    handler->connectionLost(event.message.payload);
+                    break;
+                case EventType::Message:
+                    handler->messageArrived(event.message);
+                    break;
+            }
+            lock.lock();
+
+            // The ack goes out once the handler returned, unless the connection is gone by then
+            sessionIt = _sessions.find(event.clientId);
+            if (event.type == EventType::Message && event.message.qos > 0 && sessionIt != _sessions.end()) {
+                Session& ackSession = sessionIt->second;
+                if (ackSession.online && ackSession.connection == connection) {
+                    ackSession.acked.push_back(std::move(event.message));
+                    if (ackSession.acked.size() > MAX_ACKED_MESSAGES) {
+                        ackSession.acked.pop_front();
+                    }
+                } else if (!ackSession.cleanSession && ackSession.online) {
+                    // Reconnected while the handler ran, redeliver on the new connection
+                    event.message.duplicate = true;
+                    _events.push_back(Event{event.clientId, EventType::Message, std::move(event.message)});
+                } else if (!ackSession.cleanSession) {
+                    ackSession.unacked.push_back(std::move(event.message));
+                }
+            }
+            _delivering.clear();
+            _cvDelivered.notify_all();
+        }
+    }
+
+    LoopbackTransport::LoopbackTransport(std::shared_ptr<LoopbackBroker> broker, std::string clientId, bool cleanSession) :
+        _broker(std::move(broker)), _clientId(std::move(clientId)), _cleanSession(cleanSession) {}
+
+    LoopbackTransport::~LoopbackTransport() {
+        _broker->disconnect(_clientId);
+    }
+
+    bool LoopbackTransport::connect() {
+        _broker->connect(_clientId, this, _cleanSession);
+        return true;
+    }
+
+    void LoopbackTransport::disconnect() {
+        _broker->disconnect(_clientId);
+    }
+
+    void LoopbackTransport::subscribe(const std::string &topicFilter, int qos) {
+        _broker->subscribe(_clientId, topicFilter, qos);
+    }
+
+    bool LoopbackTransport::publish(const std::string &topic, const std::string &payload, int qos, bool retained) {
+        TransportMessage message;
+        message.topic = topic;
+        message.payload = payload;
+        message.qos = qos;
+        message.retained = retained;
+        return _broker->publish(_clientId, message);
+    }
+
+} // lm
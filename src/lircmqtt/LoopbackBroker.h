@@ -0,0 +1,126 @@
+#ifndef LIRC_MQTT_LOOPBACKBROKER_H
+#define LIRC_MQTT_LOOPBACKBROKER_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Transport.h"
+
+namespace lm {
+
+    class LoopbackTransport;
+
+    // mqttServer prefix selecting the in-process broker, e.g. loopback://bench
+    const std::string LOOPBACK_SCHEME = "loopback://";
+
+    /**
+     * In-process stand-in for an MQTT broker, for load tests and benchmarks of
+     * the bridge without network or broker overhead. Supports topic filters with
+     * + and # wildcards, retained messages and QoS 0/1 semantics: QoS 1 messages
+     * for a disconnected persistent session are queued and delivered on
+     * reconnect, QoS 0 messages are dropped. A QoS 1 message counts as
+     * acknowledged once the handler returned on the same connection, unacknowledged
+     * ones are delivered again with the DUP flag on reconnect. Delivery happens in
+     * publish order on a single broker thread, which makes runs deterministic.
+     */
+    class LoopbackBroker {
+    private:
+        struct Session {
+            // Kept after a dropped connection until the transport disconnects
+            LoopbackTransport* client = nullptr;
+            bool online = false;
+            bool cleanSession = true;
+            std::map<std::string, int> subscriptions;
+            std::deque<TransportMessage> offlineQueue;
+            // Delivered but not acknowledged, redelivered with DUP on reconnect
+            std::deque<TransportMessage> unacked;
+            // Latest acknowledged messages, their acks can be lost by dropConnection
+            std::deque<TransportMessage> acked;
+            uint16_t nextPacketId = 0;
+            // Incremented on every connect, acks only count on the connection that got the message
+            uint64_t connection = 0;
+        };
+
+        enum class EventType {
+            Connected,
+            ConnectionLost,
+            Message
+        };
+
+        struct Event {
+            std::string clientId;
+            EventType type;
+            TransportMessage message;
+        };
+
+        static const size_t MAX_OFFLINE_MESSAGES = 1000;
+        static const size_t MAX_ACKED_MESSAGES = 64;
+
+        std::mutex _sync;
+        std::condition_variable _cvEvent;
+        std::condition_variable _cvDelivered;
+        std::map<std::string, Session> _sessions;
+        std::map<std::string, TransportMessage> _retained;
+        std::deque<Event> _events;
+        std::string _delivering;
+        bool _bShutdown = false;
+        std::thread _thread;
+
+        void run();
+        void enqueueMessage(const std::string& clientId, Session& session, TransportMessage message, int qos);
+        void waitUntilNotDelivering(std::unique_lock<std::mutex>& lock, const std::string& clientId);
+
+    public:
+        LoopbackBroker();
+        ~LoopbackBroker();
+
+        LoopbackBroker(const LoopbackBroker&) = delete;
+        LoopbackBroker& operator=(const LoopbackBroker&) = delete;
+
+        // Broker shared by all users of loopback://<name> in this process
+        static std::shared_ptr<LoopbackBroker> get(const std::string& name);
+
+        static bool topicMatches(const std::string& topicFilter, const std::string& topic);
+
+        void connect(const std::string& clientId, LoopbackTransport* client, bool cleanSession);
+        void disconnect(const std::string& clientId);
+        // Simulates a network failure, the client gets connectionLost. The acks of
+        // the last lostAcks QoS 1 messages did not reach the broker
+        void dropConnection(const std::string& clientId, const std::string& cause, size_t lostAcks = 0);
+        // The client of a dropped connection connects again, as with automatic reconnect
+        bool reconnect(const std::string& clientId);
+        bool subscribe(const std::string& clientId, const std::string& topicFilter, int qos);
+        bool publish(const std::string& clientId, const TransportMessage& message);
+    };
+
+    class LoopbackTransport : public Transport {
+    private:
+        std::shared_ptr<LoopbackBroker> _broker;
+        std::string _clientId;
+        bool _cleanSession;
+        TransportHandler* _handler = nullptr;
+
+        friend class LoopbackBroker;
+
+    public:
+        LoopbackTransport(std::shared_ptr<LoopbackBroker> broker, std::string clientId, bool cleanSession);
+        ~LoopbackTransport() override;
+
+        void setHandler(TransportHandler* handler) override {
+            _handler = handler;
+        }
+
+        bool connect() override;
+        void disconnect() override;
+        void subscribe(const std::string& topicFilter, int qos) override;
+        bool publish(const std::string& topic, const std::string& payload, int qos, bool retained) override;
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_LOOPBACKBROKER_H
@@ -5,288 +5,502 @@
 #include "MqttConsumer.h"
 
 #include <utility>
+#include <memory>
 
 #include <thread>
 #include <chrono>
-#include <lirc_client.h>
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
+#include "PahoTransport.h"
+#include "LoopbackBroker.h"
+#include "BufferedTransport.h"
 
-void sendLircControl(const std::string& lircdSocketPath, const std::string& deviceName, const std::string& button)
-{
-    int fd;
+int lm::MqttConsumer::consume() {
+    const Properties& properties = _deviceStateManager->getProperties();
 
-    fd = lirc_get_local_socket(lircdSocketPath.c_str(), 0);
-    if (fd < 0) {
-        std::cout << "Error initializing Lirc" << std::endl;
-        return;
-    }
-    if (lirc_send_one(fd, deviceName.c_str(), button.c_str()) == -1) {
-        std::cout << "Error sending Lirc control" << std::endl;
+    std::unique_ptr<Transport> backend;
+    if (properties.mqttServer.compare(0, LOOPBACK_SCHEME.length(), LOOPBACK_SCHEME) == 0) {
+        std::cout << "Using in-process loopback broker " << properties.mqttServer << std::endl;
+        backend.reset(new LoopbackTransport(LoopbackBroker::get(properties.mqttServer.substr(LOOPBACK_SCHEME.length())),
+                                              clientId(properties), false));
     } else {
-        std::cout << "Lirc control was sent successfully" << std::endl;
+        backend.reset(new PahoTransport(properties.mqttServer, clientId(properties)));
     }
-    close(fd);
-}
-
-
-int lm::MqttConsumer::consume() {
-    // A subscriber often wants the server to remember its messages when its
-    // disconnected. In that case, it needs a unique ClientID and a
-    // non-clean session.
-
-    mqtt::async_client cli(_deviceStateManager->getProperties().mqttServer, _deviceStateManager->getProperties().serviceName);
-
-    mqtt::connect_options connOpts;
-    connOpts.set_clean_session(false);
+    std::unique_ptr<BufferedTransport> transport(new BufferedTransport(std::move(backend), properties.outboundBufferTopics, properties.outboundBufferFile));
 
-    // Install the callback(s) before connecting.
-    callback cb(cli, connOpts, _deviceStateManager);
-    cli.set_callback(cb);
+    // States published before a restart during an outage are the latest known states
+    for (const auto& message : transport->pending()) {
+        if (message.topic.compare(0, properties.deviceTopicPrefix.length(), properties.deviceTopicPrefix) != 0) {
+            continue;
+        }
+        std::string deviceName = message.topic.substr(properties.deviceTopicPrefix.length());
+        rapidjson::Document state;
+        state.Parse(message.payload);
+        if (deviceName.find('/') == std::string::npos && !state.HasParseError()) {
+            _deviceStateManager->applyStateDescription(deviceName, state);
+        }
+    }
 
-    // Start the connection.
-    // When completed, the callback will subscribe to topic.
+    // Install the callback before connecting.
+    callback cb(*transport, _deviceStateManager, _tracer);
+    transport->setHandler(&cb);
 
-    try {
-        std::cout << "Connecting to the MQTT server at " << _deviceStateManager->getProperties().mqttServer << " with client id " << _deviceStateManager->getProperties().serviceName << " ..." << std::endl << std::flush;
-        cli.connect(connOpts, nullptr, cb);
-    }
-    catch (const mqtt::exception& exc) {
-        std::cerr << "\nERROR: Unable to connect to MQTT server: '"
-                  << _deviceStateManager->getProperties().mqttServer << "'" << exc << std::endl;
+    // When connected, the callback will subscribe to the device topics.
+    if (!transport->connect()) {
         return 1;
     }
 
     if(!isRunning) {
+        transport->disconnect();
         return 0;
     }
 
-    // Just block till user tells us to quit.
+    // Just block till user tells us to quit, logging the airtime stats on request or periodically.
     {
+        auto interval = std::chrono::milliseconds(properties.airtimeStatsIntervalMs);
+        auto nextStats = std::chrono::steady_clock::now() + interval;
         std::unique_lock<std::mutex> lk(m);
-        cv.wait(lk);
+        while (isRunning) {
+            if (interval.count() > 0) {
+                cv.wait_until(lk, nextStats);
+            } else {
+                cv.wait(lk);
+            }
+            bool due = interval.count() > 0 && std::chrono::steady_clock::now() >= nextStats;
+            if (due) {
+                nextStats = std::chrono::steady_clock::now() + interval;
+            }
+            if ((statsRequested.exchange(false) || due) && isRunning) {
+                cb.logAirtimeStats();
+            }
+        }
     }
 
-    // Disconnect
-
-    try {
-        std::cout << "\nDisconnecting from the MQTT server..." << std::flush;
-        cli.disconnect()->wait();
-        std::cout << "OK" << std::endl;
-    }
-    catch (const mqtt::exception& exc) {
-        std::cerr << exc << std::endl;
-        return 1;
-    }
+    transport->disconnect();
 
     return 0;
 }
 
-lm::MqttConsumer::MqttConsumer(const std::shared_ptr<DeviceStateManager>& deviceStateManager) :
-    _deviceStateManager(deviceStateManager), isRunning(true) {}
+lm::MqttConsumer::MqttConsumer(const std::shared_ptr<DeviceStateManager>& deviceStateManager, const std::shared_ptr<Tracer>& tracer) :
+    _deviceStateManager(deviceStateManager), _tracer(tracer), isRunning(true), statsRequested(false) {}
+
+void lm::callback::connected() {
+    std::vector<std::string> localDeviceNames = _deviceStateManager->getLocalDeviceNames();
 
-void lm::callback::reconnect() {
-    std::this_thread::sleep_for(std::chrono::milliseconds(2500));
-    try {
-        cli_.connect(connOpts_, nullptr, *this);
+    for (const auto &deviceName: localDeviceNames) {
+        subscribeDeviceUpdates(deviceName);
     }
-    catch (const mqtt::exception &exc) {
-        std::cerr << "Error: " << exc.what() << std::endl;
-        exit(1);
+
+    // Every node publishes the same discovery of all devices of the shared config
+    sendDeviceDiscovery(_deviceStateManager->getDeviceNames());
+
+    for (const auto &deviceName: localDeviceNames) {
+        sendDeviceState(deviceName);
     }
 }
 
-void lm::callback::on_failure(const mqtt::token &tok) {
-    std::cout << "Connection attempt failed to " << tok.get_connect_response().get_server_uri() << ", found session: " << tok.get_connect_response().is_session_present() << std::endl;
-    if (++nretry_ > N_RETRY_ATTEMPTS)
-        exit(1);
-    reconnect();
+void lm::callback::connectionLost(const std::string &cause) {
+    // Commands already queued are still executed, their state is published once reconnected
 }
 
-void lm::callback::connected(const std::string &cause) {
-    std::cout << "\nConnection success" << std::endl;
+bool do_send_command_error(lm::Transport& transport, const std::shared_ptr<lm::DeviceStateManager>& deviceStateManager, const std::string &deviceName, const lm::DeviceCommand& command, const char* reason, long waitMs) {
 
-    std::vector<std::string> allDeviceNames = _deviceStateManager->getDeviceNames();
+    rapidjson::Document error;
+    error.SetObject();
+    auto& allocator = error.GetAllocator();
+    error.AddMember("toggle", rapidjson::Value(command.toggleName, allocator), allocator);
+    error.AddMember("value", rapidjson::Value(command.value, allocator), allocator);
+    error.AddMember("reason", rapidjson::StringRef(reason), allocator);
+    error.AddMember("waitMs", static_cast<int64_t>(waitMs), allocator);
+    error.AddMember("deadlineMs", command.deadlineMs, allocator);
 
-    for (const auto &deviceName: allDeviceNames) {
-        subscribeDeviceUpdates(deviceName);
-    }
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    error.Accept(writer);
 
-    sendDeviceDiscovery(allDeviceNames);
+    return transport.publish(deviceStateManager->getProperties().deviceTopicPrefix + deviceName + "/error", buffer.GetString(), lm::QOS, false);
+}
 
-    for (const auto &deviceName: allDeviceNames) {
-        sendDeviceState(deviceName);
-    }
+bool do_publish_device_state(lm::Transport& transport, const std::shared_ptr<lm::DeviceStateManager>& deviceStateManager, const std::string &deviceName, const rapidjson::Document& mqttDeviceState) {
+
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    mqttDeviceState.Accept(writer);
+    const char *output = buffer.GetString();
+
+    std::cout << "Sending device state update message for " << deviceName << std::endl;
+    return transport.publish(deviceStateManager->getProperties().deviceTopicPrefix + deviceName, output, lm::QOS, false);
 }
 
-void lm::callback::connection_lost(const std::string &cause) {
-    std::cout << "\nConnection lost" << std::endl;
-    if (!cause.empty())
-        std::cout << "\tcause: " << cause << std::endl;
+bool do_send_device_state(lm::Transport& transport, const std::shared_ptr<lm::DeviceStateManager>& deviceStateManager, const std::string &deviceName) {
+
+    rapidjson::Document mqttDeviceState;
+    mqttDeviceState.SetObject();
+    deviceStateManager->asStateDescription(deviceName, mqttDeviceState, mqttDeviceState);
+
+    return do_publish_device_state(transport, deviceStateManager, deviceName, mqttDeviceState);
+}
+
+bool do_send_pending_device_state(lm::Transport& transport, const std::shared_ptr<lm::DeviceStateManager>& deviceStateManager, const std::string &deviceName, const std::vector<std::pair<std::string, std::string>>& targets) {
+
+    rapidjson::Document mqttDeviceState;
+    mqttDeviceState.SetObject();
+    if (!deviceStateManager->asPendingStateDescription(deviceName, targets, mqttDeviceState, mqttDeviceState)) {
+        return false;
+    }
 
-    std::cout << "Reconnecting..." << std::endl;
-    nretry_ = 0;
-    reconnect();
+    return do_publish_device_state(transport, deviceStateManager, deviceName, mqttDeviceState);
 }
 
-void lm::callback::message_arrived(mqtt::const_message_ptr msg) {
+void lm::callback::messageArrived(const TransportMessage &message) {
+    // Redelivered after a reconnect, running a relative press sequence again would desync the state
+    if (_duplicates.isDuplicate(message)) {
+        std::cout << "Dropping duplicate delivery of message on " << message.topic << std::endl;
+        return;
+    }
+
+    uint64_t traceId = _tracer->startTrace();
+    TraceScope span(_tracer.get(), traceId, "message_arrived", message.topic);
+
     std::cout << "Message arrived" << std::endl;
-    std::cout << "\ttopic: '" << msg->get_topic() << "'" << std::endl;
-    std::cout << "\tpayload: '" << msg->to_string() << "'\n" << std::endl;
+    std::cout << "\ttopic: '" << message.topic << "'" << std::endl;
+    std::cout << "\tpayload: '" << message.payload << "'\n" << std::endl;
 
-    std::string deviceName = msg->get_topic().substr(_deviceStateManager->getProperties().deviceTopicPrefix.length());
+    std::string deviceName = message.topic.substr(_deviceStateManager->getProperties().deviceTopicPrefix.length());
     auto lastSlash = deviceName.find_last_of('/');
     if (lastSlash != std::string::npos) {
         deviceName = deviceName.substr(0, lastSlash);
     }
 
-    auto queueIt = messageQueue.find(deviceName);
-    if (queueIt == messageQueue.end()) {
+    auto workerIt = _deviceWorkers.find(deviceName);
+    if (workerIt == _deviceWorkers.end()) {
         std::cout << "Error processing message, unknown device: " << deviceName << std::endl;
-    } else {
-        queueIt->second.first->push(msg->to_string());
+        return;
+    }
+
+    rapidjson::Document messageJson;
+    messageJson.Parse(message.payload);
+    if (messageJson.HasParseError() || !messageJson.IsObject()) {
+        std::cout << "Error processing message, invalid payload for device: " << deviceName << std::endl;
+        return;
+    }
+
+    auto& worker = *workerIt->second;
+    const DeviceConfigTable& config = _deviceStateManager->getConfiguration();
+    const DeviceConfig& device = config.device(config.findDevice(deviceName));
+    std::vector<DeviceCommand> commands;
+    for (auto it = messageJson.MemberBegin(); it != messageJson.MemberEnd(); ++it) {
+        DeviceCommand command;
+        command.toggleName = it->name.GetString();
+        // Numeric features are set with JSON numbers
+        if (it->value.IsString()) {
+            command.value = it->value.GetString();
+        } else if (it->value.IsInt64()) {
+            command.value = std::to_string(it->value.GetInt64());
+        } else if (it->value.IsNumber()) {
+            command.value = std::to_string(it->value.GetDouble());
+        } else {
+            std::cout << "Error processing message, unsupported value for " << command.toggleName << " of device: " << deviceName << std::endl;
+            continue;
+        }
+        command.deadlineMs = config.deadlineMs(device, command.toggleName);
+        // Only a newer target state of the same toggle makes a queued command obsolete
+        int32_t toggleIndex = config.findToggle(device, command.toggleName);
+        bool sequenced = toggleIndex != DeviceConfigTable::NOT_FOUND && !config.toggle(toggleIndex).delay;
+        std::string admissionKey = sequenced ? command.toggleName : std::string();
+        // Rejected before it is sequenced, so it does not supersede queued commands
+        long predictedWaitMs = worker.admission.predictedWaitMs(admissionKey);
+        if (command.deadlineMs > 0 && predictedWaitMs > static_cast<long>(command.deadlineMs)) {
+            std::cout << "Rejecting command for " << deviceName << ", toggle: " << command.toggleName << ", predicted wait " << predictedWaitMs << "ms exceeds deadline " << command.deadlineMs << "ms" << std::endl;
+            do_send_command_error(_transport, _deviceStateManager, deviceName, command, "overloaded", predictedWaitMs);
+            continue;
+        }
+        command.sequence = sequenced ? worker.sequencer.issue(command.toggleName) : CommandSequencer::UNSEQUENCED;
+        worker.admission.queued(admissionKey);
+        command.lastInMessage = false;
+        command.publishedPending = false;
+        command.traceId = traceId;
+        command.enqueued = TraceClock::now();
+        commands.push_back(command);
+    }
+
+    if (!commands.empty()) {
+        commands.back().lastInMessage = true;
+    }
+
+    // Dashboards show the targets once accepted, the publish after the sequences confirms or corrects them
+    if (_deviceStateManager->getProperties().optimisticState) {
+        std::vector<std::pair<std::string, std::string>> targets;
+        for (const auto& command : commands) {
+            if (command.sequence != CommandSequencer::UNSEQUENCED) {
+                targets.emplace_back(command.toggleName, command.value);
+            }
+        }
+        if (!targets.empty()) {
+            TraceScope pendingSpan(_tracer.get(), traceId, "do_send_pending_device_state", deviceName);
+            bool publishedPending = do_send_pending_device_state(_transport, _deviceStateManager, deviceName, targets);
+            for (auto& command : commands) {
+                command.publishedPending = publishedPending;
+            }
+        }
+    }
+
+    for (const auto& command : commands) {
+        worker.queue.push(command);
     }
 }
 
-void do_send_device_state(mqtt::async_client& cli, const std::shared_ptr<lm::DeviceStateManager>& deviceStateManager, const std::string &deviceName) {
+bool lm::callback::executeCommand(const std::string &deviceName, DeviceWorker &worker, const DeviceCommand &command) {
 
-    rapidjson::Document mqttDeviceState;
-    mqttDeviceState.SetObject();
-    deviceStateManager->asStateDescription(deviceName, mqttDeviceState, mqttDeviceState);
+    const std::string& toggleName = command.toggleName;
+    const std::string& value = command.value;
 
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-    mqttDeviceState.Accept(writer);
-    const char *output = buffer.GetString();
+    if (toggleName == "reset") {
+        if (value == "TOGGLE") {
+            std::cout << "Resetting state for device " << deviceName << std::endl;
+            _deviceStateManager->resetDeviceState(deviceName);
+            return false;
+        }
+    }
 
-    std::cout << "Sending device state update message for " << deviceName << std::endl;
-    cli.publish(deviceStateManager->getProperties().deviceTopicPrefix + deviceName, output, 1, false);
+    if (toggleName == "macro") {
+        return runMacro(deviceName, worker, command);
+    }
+
+    std::vector<uint32_t> commands;
+    int numInvokes;
+    bool resetState = false;
+    long controlIntervalMs = 0;
+    long holdMs = 0;
+    long delayMs = 0;
+
+    bool planned;
+    {
+        TraceScope span(_tracer.get(), command.traceId, "move_to_state", toggleName);
+        planned = _deviceStateManager->moveToState(deviceName, toggleName, value, commands, numInvokes, resetState, controlIntervalMs, holdMs, delayMs);
+    }
+    if (!planned) {
+        std::cout << "WARN could not determine requires buttons to press to enter state for device: " << deviceName << ", toggle: " << toggleName << ", value: " << std::endl;
+        return false;
+    }
+
+    if (delayMs > 0) {
+        worker.admission.expectRemaining(std::chrono::milliseconds(delayMs));
+        std::cout << "Pausing " << deviceName << " for " << delayMs << "ms" << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+        _deviceStateManager->setState(deviceName, toggleName, value);
+        return true;
+    }
+
+    const DeviceConfigTable& config = _deviceStateManager->getConfiguration();
+    std::string buttonString;
+    for (auto lircCommand : commands) {
+        buttonString += config.arena().str(config.command(lircCommand).button) + " ";
+    }
+    std::cout << "Invoking IR control for " << deviceName << " with button(s) " << buttonString << ": " << numInvokes << " times" << std::endl;
+    AirtimePriority priority = numInvokes > 1 ? AirtimePriority::Bulk : AirtimePriority::Interactive;
+
+    // At least the paced presses, refined from the progress of the sequence below
+    if (holdMs > 0) {
+        worker.admission.expectRemaining(std::chrono::milliseconds(holdMs));
+    } else if (numInvokes > 1 && controlIntervalMs > 0) {
+        worker.admission.expectRemaining(std::chrono::milliseconds(controlIntervalMs * numInvokes * static_cast<long>(commands.size())));
+    }
+
+    if (holdMs > 0) {
+        std::cout << "Holding for " << holdMs << "ms instead" << std::endl;
+        if (!_scheduler.hold(deviceName, commands[0], std::chrono::milliseconds(holdMs), priority, command.traceId)) {
+            // How far the hold got is unknown, keep the previous state
+            std::cout << "WARN hold failed for " << deviceName << ", toggle " << toggleName << " keeps its previous state" << std::endl;
+            return false;
+        }
+        numInvokes = 0;
+    }
+    TraceClock::time_point firstPressed;
+    for (int i=0; i < numInvokes; i++) {
+        // A newer command for the same toggle takes over from the state reached so far
+        if (i > 0 && worker.sequencer.isSuperseded(toggleName, command.sequence)) {
+            std::string intermediateValue;
+            if (_deviceStateManager->intermediateState(deviceName, toggleName, value, i, intermediateValue)) {
+                std::cout << "Command superseded for " << deviceName << " after " << i << " of " << numInvokes << " invokes, toggle " << toggleName << " is at " << intermediateValue << std::endl;
+                _deviceStateManager->setState(deviceName, toggleName, intermediateValue);
+                return true;
+            }
+        }
+        for (auto lircCommand : commands) {
+            // Pacing by controlIntervalMs happens in the scheduler
+            if (!_scheduler.send(deviceName, lircCommand, priority, command.traceId)) {
+                // Stop, further presses would start from a state we don't know
+                std::string intermediateValue;
+                if (i > 0 && _deviceStateManager->intermediateState(deviceName, toggleName, value, i, intermediateValue)) {
+                    std::cout << "WARN sending failed for " << deviceName << " after " << i << " of " << numInvokes << " invokes, toggle " << toggleName << " is at " << intermediateValue << std::endl;
+                    _deviceStateManager->setState(deviceName, toggleName, intermediateValue);
+                    return true;
+                }
+                std::cout << "WARN sending failed for " << deviceName << ", toggle " << toggleName << " keeps its previous state" << std::endl;
+                return false;
+            }
+        }
+        // The first press is not paced, the ones after it tell how long the rest takes
+        if (i == 0) {
+            firstPressed = TraceClock::now();
+        } else {
+            worker.admission.expectRemaining((TraceClock::now() - firstPressed) / i * (numInvokes - i - 1));
+        }
+    }
+    if (resetState) {
+        _deviceStateManager->resetDeviceState(deviceName);
+    }
+    _deviceStateManager->setState(deviceName, toggleName, value);
+    return resetState || numInvokes > 0 || holdMs > 0;
 }
 
+bool lm::callback::runMacro(const std::string &deviceName, DeviceWorker &worker, const DeviceCommand &command) {
 
-lm::callback::callback(mqtt::async_client &cli, mqtt::connect_options &connOpts, const std::shared_ptr<DeviceStateManager>& deviceStateManager)
-        : nretry_(0), cli_(cli), connOpts_(connOpts), subListener_("Subscription"), _deviceStateManager(deviceStateManager) {
-    auto names = _deviceStateManager->getDeviceNames();
+    const DeviceConfigTable& config = _deviceStateManager->getConfiguration();
+    int32_t deviceIndex = config.findDevice(deviceName);
+    int32_t macroIndex = deviceIndex == DeviceConfigTable::NOT_FOUND ? DeviceConfigTable::NOT_FOUND : config.findMacro(config.device(deviceIndex), command.value);
+    if (macroIndex == DeviceConfigTable::NOT_FOUND) {
+        std::cout << "WARN unknown macro " << command.value << " for device: " << deviceName << std::endl;
+        return false;
+    }
 
-    for (const auto& deviceName : names) {
-        auto queue = std::make_shared<BlockingQueue<std::string>>();
-        auto lDeviceStateManager = _deviceStateManager;
+    const MacroConfig& macro = config.macro(macroIndex);
+    std::cout << "Running macro " << command.value << " for " << deviceName << ": " << macro.stepsCount << " presses" << std::endl;
+    AirtimePriority priority = macro.stepsCount > 1 ? AirtimePriority::Bulk : AirtimePriority::Interactive;
+
+    // Offsets are relative to the start, time spent sending counts towards the next delay
+    auto start = std::chrono::steady_clock::now();
+    worker.admission.expectRemaining(std::chrono::milliseconds(config.macroStep(macro.stepsBegin + macro.stepsCount - 1).offsetMs));
+    uint32_t stepsDone = 0;
+    for (; stepsDone < macro.stepsCount; stepsDone++) {
+        const MacroStep& step = config.macroStep(macro.stepsBegin + stepsDone);
+        std::this_thread::sleep_until(start + std::chrono::milliseconds(step.offsetMs));
+        if (!_scheduler.send(deviceName, step.command, priority, command.traceId)) {
+            std::cout << "WARN macro " << command.value << " for " << deviceName << " stopped after " << stepsDone << " of " << macro.stepsCount << " presses" << std::endl;
+            break;
+        }
+    }
 
-        auto t = std::make_shared<std::thread>([lDeviceStateManager, deviceName, queue, this] {
+    return _deviceStateManager->applyMacro(deviceName, static_cast<uint32_t>(macroIndex), stepsDone);
+}
 
-            std::string message;
+lm::callback::callback(Transport &transport, const std::shared_ptr<DeviceStateManager>& deviceStateManager, const std::shared_ptr<Tracer>& tracer)
+        : _transport(transport), _deviceStateManager(deviceStateManager), _tracer(tracer),
+          _scheduler(deviceStateManager->getConfiguration(), deviceStateManager->getProperties().lircdSocketPath, deviceStateManager->getProperties().emitterGapMs,
+                     deviceStateManager->getProperties().transmitPriority, tracer),
+          _duplicates(deviceStateManager->getProperties().duplicateWindowMs) {
+    auto names = _deviceStateManager->getLocalDeviceNames();
 
-            std::chrono::milliseconds lastSentTime = std::chrono::milliseconds::min();
+    const DeviceConfigTable& config = _deviceStateManager->getConfiguration();
+    for (const auto& deviceName : names) {
+        const DeviceConfig& deviceConfig = config.device(config.findDevice(deviceName));
+        _scheduler.addDevice(deviceName, deviceConfig.controlIntervalMs, deviceConfig.airtimeWeight);
 
-            while (queue->pop(message)) {
-                rapidjson::Document messageJson;
-                messageJson.Parse(message);
+        auto worker = std::make_shared<DeviceWorker>();
 
-                bool wasUpdated = false;
-                for (auto it = messageJson.MemberBegin(); it != messageJson.MemberEnd(); ++it) {
+        worker->thread = std::make_shared<std::thread>([deviceName, worker, this] {
 
-                    std::string toggleName = it->name.GetString();
-                    std::string value = it->value.GetString();
+            DeviceCommand command;
+            bool wasUpdated = false;
 
-                    if (toggleName == "reset") {
-                        if (value == "TOGGLE") {
-                            std::cout << "Resetting state for device " << deviceName << std::endl;
-                            lDeviceStateManager->resetDeviceState(deviceName);
-                            continue;
-                        }
-                    }
+            while (worker->queue.pop(command)) {
+                _tracer->record(command.traceId, "dequeue", command.toggleName, command.enqueued, TraceClock::now());
 
-                    std::vector<std::string> buttons;
-                    int numInvokes;
-                    bool resetState = false;
-                    long controlIntervalMs = 0;
-
-                    if (lDeviceStateManager->moveToState(deviceName, toggleName, value, buttons, numInvokes, resetState, controlIntervalMs)) {
-                        std::string buttonString;
-                        for (const auto& button : buttons) {
-                            buttonString += button + " ";
-                        }
-                        std::cout << "Invoking IR control for " << deviceName << " with button(s) " << buttonString << ": " << numInvokes << " times" << std::endl;
-                        for (int i=0; i < numInvokes; i++) {
-                            for (const auto& button : buttons) {
-                                if (toggleName == "sleep") {
-                                    std::this_thread::sleep_for(std::chrono::milliseconds(std::stoi(value)));
-                                } else {
-                                    if (controlIntervalMs > 0) {
-                                        auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                                std::chrono::system_clock::now().time_since_epoch()
-                                        );
-                                        std::chrono::milliseconds ms = std::chrono::milliseconds(controlIntervalMs);
-                                        std::chrono::milliseconds nextSentTime = lastSentTime + ms;
-                                        if (nextSentTime > now) {
-                                            std::this_thread::sleep_for(nextSentTime - now);
-                                        }
-                                    }
-                                    sendLircControl(lDeviceStateManager->getProperties().lircdSocketPath, deviceName,
-                                                    button);
-                                    lastSentTime = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                            std::chrono::system_clock::now().time_since_epoch()
-                                    );
-                                }
-                            }
-                        }
-                        wasUpdated = resetState || numInvokes > 0;
-                        if (resetState) {
-                            lDeviceStateManager->resetDeviceState(deviceName);
-                        }
-                        lDeviceStateManager->setState(deviceName, toggleName, value);
-                    } else {
-                        std::cout << "WARN could not determine requires buttons to press to enter state for device: " << deviceName << ", toggle: " << toggleName << ", value: " << std::endl;
+                auto started = TraceClock::now();
+                auto waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(started - command.enqueued).count();
+                worker->admission.started(command.sequence != CommandSequencer::UNSEQUENCED ? command.toggleName : std::string());
+                TraceClock::duration serviceTime = TraceClock::duration::zero();
+                // A pending state published on admission is confirmed or corrected in any case
+                if (command.publishedPending) {
+                    wasUpdated = true;
+                }
+                if (worker->sequencer.isSuperseded(command.toggleName, command.sequence)) {
+                    std::cout << "Skipping superseded command for " << deviceName << ", toggle: " << command.toggleName << ", value: " << command.value << std::endl;
+                } else if (command.deadlineMs > 0 && waitMs > command.deadlineMs) {
+                    std::cout << "Dropping expired command for " << deviceName << ", toggle: " << command.toggleName << ", waited " << waitMs << "ms" << std::endl;
+                    do_send_command_error(_transport, _deviceStateManager, deviceName, command, "expired", static_cast<long>(waitMs));
+                } else {
+                    if (executeCommand(deviceName, *worker, command)) {
+                        wasUpdated = true;
                     }
+                    serviceTime = TraceClock::now() - started;
                 }
-                if (wasUpdated) {
-                    do_send_device_state(cli_, lDeviceStateManager, deviceName);
+                worker->admission.finished(serviceTime);
+
+                if (command.lastInMessage && wasUpdated) {
+                    TraceScope span(_tracer.get(), command.traceId, "do_send_device_state", deviceName);
+                    do_send_device_state(_transport, _deviceStateManager, deviceName);
+                    wasUpdated = false;
                 }
             }
         });
 
-        messageQueue.insert(std::make_pair(deviceName, std::make_pair(queue, t)));
+        _deviceWorkers.insert(std::make_pair(deviceName, worker));
 
     }
+
+    if (_deviceStateManager->getProperties().lircdReceive) {
+        _receiver.reset(new LircReceiver(_deviceStateManager->getProperties().lircdSocketPath,
+                                         [this](const std::string& remote, const std::string& button, std::chrono::steady_clock::time_point received) {
+            buttonReceived(remote, button, received);
+        }));
+        _receiver->start();
+    }
+}
+
+void lm::callback::buttonReceived(const std::string &deviceName, const std::string &button, std::chrono::steady_clock::time_point received) {
+    // lircd reports the remote name, which is the device name used for sending
+    if (_deviceWorkers.find(deviceName) == _deviceWorkers.end() || !_deviceStateManager->applyReceivedButton(deviceName, button)) {
+        return;
+    }
+
+    if (!do_send_device_state(_transport, _deviceStateManager, deviceName)) {
+        return;
+    }
+
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - received);
+    std::cout << "Received " << button << " for " << deviceName << ", state published after " << latency.count() << "us" << std::endl;
 }
 
 lm::callback::~callback() {
 
-    for (auto& queueEntry : messageQueue) {
-        queueEntry.second.first->requestShutdown();
+    _receiver.reset();
+
+    for (auto& workerEntry : _deviceWorkers) {
+        workerEntry.second->queue.requestShutdown();
     }
-    for (auto& queueEntry : messageQueue) {
-        queueEntry.second.second->join();
+    for (auto& workerEntry : _deviceWorkers) {
+        workerEntry.second->thread->join();
     }
-}
 
-void lm::action_listener::on_failure(const mqtt::token &tok) {
-    std::cout << name_ << " failure";
-    if (tok.get_message_id() != 0)
-        std::cout << " for token: [" << tok.get_message_id() << "]" << std::endl;
-    std::cout << std::endl;
-}
+    std::cout << "Suppressed " << _duplicates.suppressed() << " duplicate message(s)" << std::endl;
 
-void lm::action_listener::on_success(const mqtt::token &tok) {
-    std::cout << name_ << " success";
-    if (tok.get_message_id() != 0)
-        std::cout << " for token: [" << tok.get_message_id() << "]" << std::endl;
-    auto top = tok.get_topics();
-    if (top && !top->empty())
-        std::cout << "\ttoken topic: '" << (*top)[0] << "', ..." << std::endl;
-    std::cout << std::endl;
+    logAirtimeStats();
 }
 
+void lm::callback::logAirtimeStats() {
+    for (const auto& stats : _scheduler.stats()) {
+        long averageWaitUs = stats.second.frames > 0 ? static_cast<long>(stats.second.totalWait.count() / stats.second.frames) : 0;
+        std::cout << "Airtime " << stats.first << ": " << stats.second.frames << " frames, average wait " << averageWaitUs
+                  << "us, max wait " << stats.second.maxWait.count() << "us" << std::endl;
+        std::cout << "\tpaced gaps behind controlIntervalMs:";
+        for (size_t i = 0; i < GAP_BUCKETS; i++) {
+            std::cout << " " << AirtimeScheduler::gapBucketName(i) << "=" << stats.second.gapHistogram[i];
+        }
+        std::cout << std::endl;
+    }
+}
 
 void lm::callback::subscribeDeviceUpdates(const std::string& deviceName) {
 
     std::string deviceTopicName = _deviceStateManager->getProperties().deviceTopicPrefix + deviceName + "/set";
 
     std::cout << "\nSubscribing to topic '" << deviceTopicName << "'\n"
-              << "\tfor client " << _deviceStateManager->getProperties().serviceName
+              << "\tfor client " << clientId(_deviceStateManager->getProperties())
               << " using QoS" << QOS << std::endl;
 
-    cli_.subscribe(deviceTopicName, QOS, nullptr, subListener_);
+    _transport.subscribe(deviceTopicName, QOS);
 }
 
 void lm::callback::sendDeviceDiscovery(const std::vector<std::string> &allDeviceNames) {
@@ -312,9 +526,9 @@ void lm::callback::sendDeviceDiscovery(const std::vector<std::string> &allDevice
     const char* output = buffer.GetString();
 
     std::cout << "Sending device discovery message" << std::endl;
-    cli_.publish(_deviceStateManager->getProperties().discoveryTopic, output, QOS, true);
+    _transport.publish(_deviceStateManager->getProperties().discoveryTopic, output, QOS, true);
 }
 
 void lm::callback::sendDeviceState(const std::string &deviceName) {
-    do_send_device_state(cli_, _deviceStateManager, deviceName);
+    do_send_device_state(_transport, _deviceStateManager, deviceName);
 }
@@ -7,10 +7,18 @@
 
 #include <string>
 #include <atomic>
+#include <chrono>
+#include <thread>
 #include "rapidjson/document.h"
-#include "mqtt/async_client.h"
 #include "DeviceState.h"
 #include "BlockingQueue.h"
+#include "CommandSequencer.h"
+#include "AdmissionControl.h"
+#include "AirtimeScheduler.h"
+#include "LircReceiver.h"
+#include "Tracer.h"
+#include "Transport.h"
+#include "DuplicateFilter.h"
 
 namespace Json {
     class Value;
@@ -19,90 +27,86 @@ namespace Json {
 namespace lm {
 
     const int QOS = 1;
-    const int N_RETRY_ATTEMPTS = 5;
 
-// Callbacks for the success or failures of requested actions.
-// This could be used to initiate further action, but here we just log the
-// results to the console.
-
-    class action_listener : public virtual mqtt::iaction_listener {
-        std::string name_;
-
-        void on_failure(const mqtt::token &tok) override;
+/////////////////////////////////////////////////////////////////////////////
 
-        void on_success(const mqtt::token &tok) override;
+    // A single toggle change requested by a /set message
+    struct DeviceCommand {
+        std::string toggleName;
+        std::string value;
+        uint64_t sequence;
+        uint64_t traceId;
+        TraceClock::time_point enqueued;
+        // Dropped if not started within this time after enqueued, 0 never expires
+        uint32_t deadlineMs;
+        // The device state is published once all commands of a message are processed
+        bool lastInMessage;
+        // Its target was published as pending when the message was accepted
+        bool publishedPending;
+    };
 
-    public:
-        explicit action_listener(std::string name) : name_(std::move(name)) {}
+    struct DeviceWorker {
+        BlockingQueue<DeviceCommand> queue;
+        CommandSequencer sequencer;
+        std::shared_ptr<std::thread> thread;
+        AdmissionControl admission;
     };
 
 /////////////////////////////////////////////////////////////////////////////
 
 /**
- * Local callback & listener class for use with the client connection.
- * This is primarily intended to receive messages, but it will also monitor
- * the connection to the broker. If the connection is lost, it will attempt
- * to restore the connection and re-subscribe to the topic.
+ * Local callback class for use with the transport. This is primarily intended
+ * to receive messages, on (re)connection it subscribes to the device topics
+ * and publishes discovery and state.
  */
-    class callback : public virtual mqtt::callback,
-                     public virtual mqtt::iaction_listener {
-        // Counter for the number of connection retries
-        int nretry_;
-        // The MQTT client
-        mqtt::async_client &cli_;
-        // Options to use if we need to reconnect
-        mqtt::connect_options &connOpts_;
-        // An action listener to display the result of actions.
-        action_listener subListener_;
+    class callback : public TransportHandler {
+        Transport &_transport;
 
         std::shared_ptr<DeviceStateManager> _deviceStateManager;
-        std::map<std::string, std::pair<std::shared_ptr<BlockingQueue<std::string>>, std::shared_ptr<std::thread>>> messageQueue;
-
-        // This deomonstrates manually reconnecting to the broker by calling
-        // connect() again. This is a possibility for an application that keeps
-        // a copy of it's original connect_options, or if the app wants to
-        // reconnect with different options.
-        // Another way this can be done manually, if using the same options, is
-        // to just call the async_client::reconnect() method.
-        void reconnect();
-
-        // Re-connection failure
-        void on_failure(const mqtt::token &tok) override;
-
-        // (Re)connection success
-        // Either this or connected() can be used for callbacks.
-        void on_success(const mqtt::token &tok) override {}
+        std::shared_ptr<Tracer> _tracer;
+        AirtimeScheduler _scheduler;
+        std::map<std::string, std::shared_ptr<DeviceWorker>> _deviceWorkers;
+        std::unique_ptr<LircReceiver> _receiver;
+        DuplicateFilter _duplicates;
 
         // (Re)connection success
-        void connected(const std::string &cause) override;
+        void connected() override;
 
-        // Callback for when the connection is lost.
-        // This will initiate the attempt to manually reconnect.
-        void connection_lost(const std::string &cause) override;
+        void connectionLost(const std::string &cause) override;
 
         // Callback for when a message arrives.
-        void message_arrived(mqtt::const_message_ptr msg) override;
-
-        void delivery_complete(mqtt::delivery_token_ptr token) override {}
+        void messageArrived(const TransportMessage &message) override;
 
         void sendDeviceDiscovery(const std::vector<std::string>& allDeviceNames);
         void sendDeviceState(const std::string& deviceName);
         void subscribeDeviceUpdates(const std::string& deviceName);
 
+        // Returns true if the device state changed
+        bool executeCommand(const std::string& deviceName, DeviceWorker& worker, const DeviceCommand& command);
+        // Sends the macro's precompiled timeline, returns true if the device state changed
+        bool runMacro(const std::string& deviceName, DeviceWorker& worker, const DeviceCommand& command);
+
+        void buttonReceived(const std::string& deviceName, const std::string& button, std::chrono::steady_clock::time_point received);
+
     public:
-        callback(mqtt::async_client &cli, mqtt::connect_options &connOpts, const std::shared_ptr<DeviceStateManager>& deviceStateManager);
+        callback(Transport &transport, const std::shared_ptr<DeviceStateManager>& deviceStateManager, const std::shared_ptr<Tracer>& tracer);
         ~callback() override;
+
+        // Per-device frames and waiting times at the emitter since the start
+        void logAirtimeStats();
     };
 
     class MqttConsumer {
     private:
         std::shared_ptr<DeviceStateManager> _deviceStateManager;
+        std::shared_ptr<Tracer> _tracer;
         std::mutex m;
         std::condition_variable cv;
         std::atomic<bool> isRunning;
+        std::atomic<bool> statsRequested;
 
     public:
-        explicit MqttConsumer(const std::shared_ptr<DeviceStateManager>& deviceStateManager);
+        MqttConsumer(const std::shared_ptr<DeviceStateManager>& deviceStateManager, const std::shared_ptr<Tracer>& tracer);
 
         int consume();
 
@@ -110,6 +114,12 @@ namespace lm {
             isRunning = false;
             cv.notify_all();
         }
+
+        // Logs the airtime stats from the consuming thread
+        void requestStats() {
+            statsRequested = true;
+            cv.notify_all();
+        }
     };
 
 }
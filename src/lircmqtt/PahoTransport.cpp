@@ -0,0 +1,120 @@
+#include "PahoTransport.h"
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+lm::PahoTransport::PahoTransport(const std::string &serverUri, const std::string &clientId)
+        : nretry_(0), cli_(serverUri, clientId), subListener_("Subscription"), _serverUri(serverUri), _clientId(clientId), _handler(nullptr) {
+    // A subscriber often wants the server to remember its messages when its
+    // disconnected. In that case, it needs a unique ClientID and a
+    // non-clean session.
+    connOpts_.set_clean_session(false);
+
+    // Install the callback(s) before connecting.
+    cli_.set_callback(*this);
+}
+
+bool lm::PahoTransport::connect() {
+    // Start the connection.
+    // When completed, the callback will subscribe to topic.
+
+    try {
+        std::cout << "Connecting to the MQTT server at " << _serverUri << " with client id " << _clientId << " ..." << std::endl << std::flush;
+        cli_.connect(connOpts_, nullptr, *this);
+    }
+    catch (const mqtt::exception& exc) {
+        std::cerr << "\nERROR: Unable to connect to MQTT server: '"
+                  << _serverUri << "'" << exc << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void lm::PahoTransport::disconnect() {
+    try {
+        std::cout << "\nDisconnecting from the MQTT server..." << std::flush;
+        cli_.disconnect()->wait();
+        std::cout << "OK" << std::endl;
+    }
+    catch (const mqtt::exception& exc) {
+        std::cerr << exc << std::endl;
+    }
+}
+
+void lm::PahoTransport::subscribe(const std::string &topicFilter, int qos) {
+    cli_.subscribe(topicFilter, qos, nullptr, subListener_);
+}
+
+bool lm::PahoTransport::publish(const std::string &topic, const std::string &payload, int qos, bool retained) {
+    try {
+        cli_.publish(topic, payload, qos, retained);
+    }
+    catch (const mqtt::exception& exc) {
+        std::cerr << "Error publishing to " << topic << ": " << exc.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void lm::PahoTransport::reconnect() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+    try {
+        cli_.connect(connOpts_, nullptr, *this);
+    }
+    catch (const mqtt::exception &exc) {
+        std::cerr << "Error: " << exc.what() << std::endl;
+        exit(1);
+    }
+}
+
+void lm::PahoTransport::on_failure(const mqtt::token &tok) {
+    std::cout << "Connection attempt failed to " << tok.get_connect_response().get_server_uri() << ", found session: " << tok.get_connect_response().is_session_present() << std::endl;
+    if (++nretry_ > N_RETRY_ATTEMPTS)
+        exit(1);
+    reconnect();
+}
+
+void lm::PahoTransport::connected(const std::string &cause) {
+    std::cout << "\nConnection success" << std::endl;
+    _handler->connected();
+}
+
+void lm::PahoTransport::connection_lost(const std::string &cause) {
+    std::cout << "\nConnection lost" << std::endl;
+    if (!cause.empty())
+        std::cout << "\tcause: " << cause << std::endl;
+
+    _handler->connectionLost(cause);
+
+    std::cout << "Reconnecting..." << std::endl;
+    nretry_ = 0;
+    reconnect();
+}
+
+void lm::PahoTransport::message_arrived(mqtt::const_message_ptr msg) {
+    TransportMessage message;
+    message.topic = msg->get_topic();
+    message.payload = msg->to_string();
+    message.qos = msg->get_qos();
+    message.retained = msg->is_retained();
+    message.duplicate = msg->is_duplicate();
+    _handler->messageArrived(message);
+}
+
+void lm::action_listener::on_failure(const mqtt::token &tok) {
+    std::cout << name_ << " failure";
+    if (tok.get_message_id() != 0)
+        std::cout << " for token: [" << tok.get_message_id() << "]" << std::endl;
+    std::cout << std::endl;
+}
+
+void lm::action_listener::on_success(const mqtt::token &tok) {
+    std::cout << name_ << " success";
+    if (tok.get_message_id() != 0)
+        std::cout << " for token: [" << tok.get_message_id() << "]" << std::endl;
+    auto top = tok.get_topics();
+    if (top && !top->empty())
+        std::cout << "\ttoken topic: '" << (*top)[0] << "', ..." << std::endl;
+    std::cout << std::endl;
+}
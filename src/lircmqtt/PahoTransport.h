@@ -0,0 +1,92 @@
+#ifndef LIRC_MQTT_PAHOTRANSPORT_H
+#define LIRC_MQTT_PAHOTRANSPORT_H
+
+#include <string>
+#include "mqtt/async_client.h"
+#include "Transport.h"
+
+namespace lm {
+
+    const int N_RETRY_ATTEMPTS = 5;
+
+// Callbacks for the success or failures of requested actions.
+// This could be used to initiate further action, but here we just log the
+// results to the console.
+
+    class action_listener : public virtual mqtt::iaction_listener {
+        std::string name_;
+
+        void on_failure(const mqtt::token &tok) override;
+
+        void on_success(const mqtt::token &tok) override;
+
+    public:
+        explicit action_listener(std::string name) : name_(std::move(name)) {}
+    };
+
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Transport on top of the paho async client. It monitors the connection to the
+ * broker, if the connection is lost, it will attempt to restore it and let the
+ * handler re-subscribe.
+ */
+    class PahoTransport : public Transport,
+                          public virtual mqtt::callback,
+                          public virtual mqtt::iaction_listener {
+        // Counter for the number of connection retries
+        int nretry_;
+        // The MQTT client
+        mqtt::async_client cli_;
+        // Options to use if we need to reconnect
+        mqtt::connect_options connOpts_;
+        // An action listener to display the result of actions.
+        action_listener subListener_;
+
+        std::string _serverUri;
+        std::string _clientId;
+        TransportHandler* _handler;
+
+        // This deomonstrates manually reconnecting to the broker by calling
+        // connect() again. This is a possibility for an application that keeps
+        // a copy of it's original connect_options, or if the app wants to
+        // reconnect with different options.
+        // Another way this can be done manually, if using the same options, is
+        // to just call the async_client::reconnect() method.
+        void reconnect();
+
+        // Re-connection failure
+        void on_failure(const mqtt::token &tok) override;
+
+        // (Re)connection success
+        // Either this or connected() can be used for callbacks.
+        void on_success(const mqtt::token &tok) override {}
+
+        // (Re)connection success
+        void connected(const std::string &cause) override;
+
+        // Callback for when the connection is lost.
+        // This will initiate the attempt to manually reconnect.
+        void connection_lost(const std::string &cause) override;
+
+        // Callback for when a message arrives.
+        void message_arrived(mqtt::const_message_ptr msg) override;
+
+        void delivery_complete(mqtt::delivery_token_ptr token) override {}
+
+    public:
+        PahoTransport(const std::string& serverUri, const std::string& clientId);
+
+        void setHandler(TransportHandler* handler) override {
+            _handler = handler;
+        }
+
+        bool connect() override;
+        void disconnect() override;
+        void subscribe(const std::string& topicFilter, int qos) override;
+        bool publish(const std::string& topic, const std::string& payload, int qos, bool retained) override;
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_PAHOTRANSPORT_H
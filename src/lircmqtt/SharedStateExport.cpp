@@ -0,0 +1,146 @@
+#include "SharedStateExport.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+    size_t align8(size_t offset) {
+        return (offset + 7) & ~static_cast<size_t>(7);
+    }
+}
+
+namespace lm {
+
+    SharedStateExport::SharedStateExport(std::string name) : _name(std::move(name)) {}
+
+    SharedStateExport::~SharedStateExport() {
+        if (_segment != nullptr) {
+            munmap(_segment, _size);
+            shm_unlink(_name.c_str());
+        }
+    }
+
+    bool SharedStateExport::create(const DeviceConfigTable &config, const std::vector<int32_t> &states) {
+        auto deviceCount = static_cast<uint32_t>(config.deviceCount());
+        auto toggleCount = static_cast<uint32_t>(config.toggleCount());
+        uint32_t valueCount = 0;
+        for (uint32_t i = 0; i < toggleCount; i++) {
+            if (!config.toggle(i).numeric) {
+                valueCount += config.valueCount(config.toggle(i));
+            }
+        }
+
+        size_t devicesOffset = align8(sizeof(SharedStateHeader));
+        size_t togglesOffset = align8(devicesOffset + deviceCount * sizeof(SharedDevice));
+        size_t valuesOffset = align8(togglesOffset + toggleCount * sizeof(SharedToggle));
+        size_t statesOffset = align8(valuesOffset + valueCount * sizeof(uint32_t));
+        size_t stringsOffset = align8(statesOffset + toggleCount * sizeof(std::atomic<int32_t>));
+
+        // Names are appended behind the tables, each stored once
+        std::string strings;
+        std::unordered_map<std::string, uint32_t> stringIndex;
+        auto intern = [&strings, &stringIndex, stringsOffset](const std::string& str) {
+            auto it = stringIndex.find(str);
+            if (it != stringIndex.end()) {
+                return it->second;
+            }
+            auto offset = static_cast<uint32_t>(stringsOffset + strings.size());
+            strings.append(str);
+            strings.push_back('\0');
+            stringIndex.insert(std::make_pair(str, offset));
+            return offset;
+        };
+
+        std::vector<SharedDevice> devices;
+        for (auto deviceIndex : config.devicesByName()) {
+            const DeviceConfig& device = config.device(deviceIndex);
+            devices.push_back(SharedDevice{intern(config.arena().str(device.name)), device.togglesBegin, device.togglesCount});
+        }
+        std::vector<SharedToggle> toggles;
+        std::vector<uint32_t> values;
+        for (uint32_t i = 0; i < toggleCount; i++) {
+            const ToggleConfig& toggle = config.toggle(i);
+            SharedToggle sharedToggle{};
+            sharedToggle.name = intern(config.arena().str(toggle.name));
+            sharedToggle.valuesBegin = static_cast<uint32_t>(values.size());
+            sharedToggle.valuesCount = config.valueCount(toggle);
+            sharedToggle.rangeMin = toggle.rangeMin;
+            sharedToggle.rangeStep = toggle.rangeStep;
+            sharedToggle.numeric = toggle.numeric ? 1 : 0;
+            if (!toggle.numeric) {
+                for (uint32_t j = 0; j < sharedToggle.valuesCount; j++) {
+                    values.push_back(intern(config.valueString(toggle, static_cast<int32_t>(j))));
+                }
+            }
+            toggles.push_back(sharedToggle);
+        }
+
+        _size = stringsOffset + strings.size();
+
+        shm_unlink(_name.c_str());
+        int fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) {
+            std::cerr << "Error creating shared state " << _name << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        void* segment = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(_size)) == 0) {
+            segment = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (segment == MAP_FAILED) {
+            std::cerr << "Error mapping shared state " << _name << ": " << std::strerror(errno) << std::endl;
+            shm_unlink(_name.c_str());
+            return false;
+        }
+        _segment = segment;
+
+        char* base = static_cast<char*>(_segment);
+        std::memcpy(base + devicesOffset, devices.data(), devices.size() * sizeof(SharedDevice));
+        std::memcpy(base + togglesOffset, toggles.data(), toggles.size() * sizeof(SharedToggle));
+        std::memcpy(base + valuesOffset, values.data(), values.size() * sizeof(uint32_t));
+        std::memcpy(base + stringsOffset, strings.data(), strings.size());
+        _states = reinterpret_cast<std::atomic<int32_t>*>(base + statesOffset);
+        for (uint32_t i = 0; i < toggleCount; i++) {
+            new (&_states[i]) std::atomic<int32_t>(states[i]);
+        }
+
+        _header = new (base) SharedStateHeader();
+        _header->version = SHARED_STATE_VERSION;
+        _header->size = static_cast<uint32_t>(_size);
+        _header->deviceCount = deviceCount;
+        _header->toggleCount = toggleCount;
+        _header->devicesOffset = static_cast<uint32_t>(devicesOffset);
+        _header->togglesOffset = static_cast<uint32_t>(togglesOffset);
+        _header->valuesOffset = static_cast<uint32_t>(valuesOffset);
+        _header->statesOffset = static_cast<uint32_t>(statesOffset);
+        _header->sequence.store(0, std::memory_order_relaxed);
+        // Readers check the magic last written, the release publishes everything above
+        _header->magic.store(SHARED_STATE_MAGIC, std::memory_order_release);
+
+        std::cout << "Exporting state of " << toggleCount << " toggles to shared memory " << _name << " (" << _size << " bytes)" << std::endl;
+        return true;
+    }
+
+    void SharedStateExport::update(const std::vector<int32_t> &states, uint32_t begin, uint32_t count) {
+        if (_header == nullptr) {
+            return;
+        }
+
+        uint32_t sequence = _header->sequence.load(std::memory_order_relaxed);
+        _header->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (uint32_t i = begin; i < begin + count; i++) {
+            _states[i].store(states[i], std::memory_order_relaxed);
+        }
+        _header->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+} // lm
@@ -0,0 +1,110 @@
+#ifndef LIRC_MQTT_SHAREDSTATEEXPORT_H
+#define LIRC_MQTT_SHAREDSTATEEXPORT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "DeviceConfig.h"
+
+namespace lm {
+
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared state requires lock-free 32 bit atomics");
+
+    /*
+     * Layout of the shared memory segment. All offsets are in bytes from the start
+     * of the segment, names are offsets of null terminated strings. Only the
+     * sequence and the states change after the segment was created. The magic is
+     * stored last with release semantics, readers load it with acquire before
+     * touching any other field.
+     */
+    const uint32_t SHARED_STATE_MAGIC = 0x4c4d5354;
+    const uint32_t SHARED_STATE_VERSION = 1;
+
+    struct SharedStateHeader {
+        std::atomic<uint32_t> magic;
+        uint32_t version;
+        // Seqlock, odd while the states are written
+        std::atomic<uint32_t> sequence;
+        uint32_t size;
+        uint32_t deviceCount;
+        uint32_t toggleCount;
+        uint32_t devicesOffset;
+        uint32_t togglesOffset;
+        // uint32_t name per value, indexed by SharedToggle::valuesBegin + value index
+        uint32_t valuesOffset;
+        // std::atomic<int32_t> value index per toggle, -1 if the value is not part of the config
+        uint32_t statesOffset;
+    };
+
+    struct SharedDevice {
+        uint32_t name;
+        uint32_t togglesBegin;
+        uint32_t togglesCount;
+    };
+
+    // Numeric toggles have no value names, value index i is rangeMin + i * rangeStep
+    struct SharedToggle {
+        uint32_t name;
+        uint32_t valuesBegin;
+        uint32_t valuesCount;
+        int32_t rangeMin;
+        int32_t rangeStep;
+        uint32_t numeric;
+    };
+
+    /**
+     * Read-only view of the toggle states for local processes, in a POSIX shared
+     * memory segment. The states are updated under a seqlock: readers retry while
+     * a write is in progress, they never take a lock or make a syscall.
+     */
+    class SharedStateExport {
+    private:
+        std::string _name;
+        void* _segment = nullptr;
+        size_t _size = 0;
+        SharedStateHeader* _header = nullptr;
+        std::atomic<int32_t>* _states = nullptr;
+
+    public:
+        explicit SharedStateExport(std::string name);
+        ~SharedStateExport();
+
+        SharedStateExport(const SharedStateExport&) = delete;
+        SharedStateExport& operator=(const SharedStateExport&) = delete;
+
+        // Creates the segment for the sealed configuration, replacing a stale one of the same name
+        bool create(const DeviceConfigTable& config, const std::vector<int32_t>& states);
+
+        // Publishes states [begin, begin + count), calls must be serialized
+        void update(const std::vector<int32_t>& states, uint32_t begin, uint32_t count);
+
+        // For readers mapping the segment: false while the segment is not completely written
+        static bool isReady(const SharedStateHeader* header) {
+            return header->magic.load(std::memory_order_acquire) == SHARED_STATE_MAGIC;
+        }
+
+        // For readers mapping the segment: copies a consistent snapshot of all states, the segment must be ready
+        static void snapshot(const SharedStateHeader* header, std::vector<int32_t>& rtnStates) {
+            auto states = reinterpret_cast<const std::atomic<int32_t>*>(reinterpret_cast<const char*>(header) + header->statesOffset);
+            rtnStates.resize(header->toggleCount);
+            for (;;) {
+                uint32_t before = header->sequence.load(std::memory_order_acquire);
+                if ((before & 1) != 0) {
+                    continue;
+                }
+                for (uint32_t i = 0; i < header->toggleCount; i++) {
+                    rtnStates[i] = states[i].load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (header->sequence.load(std::memory_order_relaxed) == before) {
+                    return;
+                }
+            }
+        }
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_SHAREDSTATEEXPORT_H
@@ -0,0 +1,142 @@
+#include "Tracer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <utility>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    void writeJsonString(std::ostream& out, const char* str) {
+        out << '"';
+        for (const char* c = str; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\') {
+                out << '\\' << *c;
+            } else if (static_cast<unsigned char>(*c) >= 0x20) {
+                out << *c;
+            }
+        }
+        out << '"';
+    }
+
+    // Written by the destructor to stop the dump thread
+    const uint64_t STOP_DUMPS = 1ull << 32;
+}
+
+namespace lm {
+
+    Tracer::Tracer(double sampleRate, size_t capacity, std::string dumpPath) :
+        _sampleRate(sampleRate), _dumpPath(std::move(dumpPath)), _commandCounter(0) {
+        if (!isEnabled()) {
+            return;
+        }
+        _ring.resize(std::max(capacity, static_cast<size_t>(1)));
+        _dumpFd = eventfd(0, EFD_CLOEXEC);
+        _dumpThread = std::thread(&Tracer::runDumps, this);
+    }
+
+    Tracer::~Tracer() {
+        if (_dumpThread.joinable()) {
+            uint64_t stop = STOP_DUMPS;
+            if (write(_dumpFd, &stop, sizeof(stop)) != sizeof(stop)) {
+                std::cerr << "Error stopping trace dumps" << std::endl;
+            }
+            _dumpThread.join();
+        }
+        if (_dumpFd >= 0) {
+            close(_dumpFd);
+        }
+    }
+
+    uint64_t Tracer::startTrace() {
+        if (!isEnabled()) {
+            return 0;
+        }
+        // Samples evenly spread commands, every command at a rate of 1
+        uint64_t command = ++_commandCounter;
+        if (std::floor(command * _sampleRate) > std::floor((command - 1) * _sampleRate)) {
+            return command;
+        }
+        return 0;
+    }
+
+    void Tracer::record(uint64_t traceId, const char *name, const std::string &detail, TraceClock::time_point start, TraceClock::time_point end) {
+        if (traceId == 0 || _ring.empty()) {
+            return;
+        }
+
+        static thread_local long threadId = syscall(SYS_gettid);
+
+        std::unique_lock<std::mutex> lock(_sync);
+        TraceSpan& span = _ring[_spanCount % _ring.size()];
+        span.traceId = traceId;
+        span.name = name;
+        strncpy(span.detail, detail.c_str(), sizeof(span.detail) - 1);
+        span.detail[sizeof(span.detail) - 1] = '\0';
+        span.threadId = threadId;
+        span.startUs = std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count();
+        span.durationUs = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        _spanCount++;
+    }
+
+    void Tracer::requestDump() {
+        if (_dumpFd >= 0) {
+            uint64_t one = 1;
+            if (write(_dumpFd, &one, sizeof(one)) != sizeof(one)) {
+                // Nothing that could be done in a signal handler
+            }
+        }
+    }
+
+    void Tracer::dump(std::ostream &out) {
+        std::vector<TraceSpan> spans;
+        {
+            std::unique_lock<std::mutex> lock(_sync);
+            size_t count = std::min(static_cast<size_t>(_spanCount), _ring.size());
+            for (size_t i = 0; i < count; i++) {
+                spans.push_back(_ring[(_spanCount - count + i) % _ring.size()]);
+            }
+        }
+
+        int pid = getpid();
+        out << "{\"traceEvents\":[";
+        for (size_t i = 0; i < spans.size(); i++) {
+            const TraceSpan& span = spans[i];
+            if (i > 0) {
+                out << ',';
+            }
+            out << "{\"name\":";
+            writeJsonString(out, span.name);
+            out << ",\"cat\":\"lirc-mqtt\",\"ph\":\"X\",\"ts\":" << span.startUs << ",\"dur\":" << span.durationUs
+                << ",\"pid\":" << pid << ",\"tid\":" << span.threadId << ",\"args\":{\"trace\":" << span.traceId << ",\"detail\":";
+            writeJsonString(out, span.detail);
+            out << "}}";
+        }
+        out << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+    }
+
+    void Tracer::runDumps() {
+        for (;;) {
+            uint64_t requests;
+            if (read(_dumpFd, &requests, sizeof(requests)) != sizeof(requests)) {
+                continue;
+            }
+            if (requests >= STOP_DUMPS) {
+                return;
+            }
+
+            std::ofstream out(_dumpPath, std::ios::trunc);
+            dump(out);
+            if (out) {
+                std::cout << "Trace written to " << _dumpPath << std::endl;
+            } else {
+                std::cerr << "Error writing trace to " << _dumpPath << std::endl;
+            }
+        }
+    }
+
+} // lm
@@ -0,0 +1,97 @@
+#ifndef LIRC_MQTT_TRACER_H
+#define LIRC_MQTT_TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace lm {
+
+    typedef std::chrono::steady_clock TraceClock;
+
+    struct TraceSpan {
+        uint64_t traceId;
+        // Span names are string literals
+        const char* name;
+        char detail[32];
+        long threadId;
+        int64_t startUs;
+        int64_t durationUs;
+    };
+
+    /**
+     * Collects timed spans of sampled commands in a fixed size ring buffer and
+     * writes them as Chrome trace-event JSON (chrome://tracing, Perfetto) when a
+     * dump is requested. Commands that are not sampled get trace id 0, recording
+     * spans for them is a no-op.
+     */
+    class Tracer {
+    private:
+        double _sampleRate;
+        std::string _dumpPath;
+        std::atomic<uint64_t> _commandCounter;
+
+        std::mutex _sync;
+        std::vector<TraceSpan> _ring;
+        uint64_t _spanCount = 0;
+
+        int _dumpFd = -1;
+        std::thread _dumpThread;
+
+        void runDumps();
+
+    public:
+        Tracer(double sampleRate, size_t capacity, std::string dumpPath);
+        ~Tracer();
+
+        Tracer(const Tracer&) = delete;
+        Tracer& operator=(const Tracer&) = delete;
+
+        bool isEnabled() const {
+            return _sampleRate > 0;
+        }
+
+        // Returns the trace id for a new command, 0 if it is not sampled
+        uint64_t startTrace();
+
+        void record(uint64_t traceId, const char* name, const std::string& detail, TraceClock::time_point start, TraceClock::time_point end);
+
+        // Async-signal-safe, the dump is written by a background thread
+        void requestDump();
+
+        void dump(std::ostream& out);
+    };
+
+    /**
+     * Records a span from construction to destruction.
+     */
+    class TraceScope {
+        Tracer* _tracer;
+        uint64_t _traceId;
+        const char* _name;
+        const std::string& _detail;
+        TraceClock::time_point _start;
+
+    public:
+        TraceScope(Tracer* tracer, uint64_t traceId, const char* name, const std::string& detail) :
+            _tracer(tracer), _traceId(traceId), _name(name), _detail(detail),
+            _start(traceId != 0 ? TraceClock::now() : TraceClock::time_point()) {}
+
+        ~TraceScope() {
+            if (_traceId != 0) {
+                _tracer->record(_traceId, _name, _detail, _start, TraceClock::now());
+            }
+        }
+
+        TraceScope(const TraceScope&) = delete;
+        TraceScope& operator=(const TraceScope&) = delete;
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_TRACER_H
@@ -0,0 +1,59 @@
+#ifndef LIRC_MQTT_TRANSPORT_H
+#define LIRC_MQTT_TRANSPORT_H
+
+#include <cstdint>
+#include <string>
+
+namespace lm {
+
+    struct TransportMessage {
+        std::string topic;
+        std::string payload;
+        int qos = 0;
+        bool retained = false;
+        // Redelivery of a QoS 1 message, if the backend can tell
+        bool duplicate = false;
+        // QoS 1 packet identifier, 0 if not known to the backend
+        uint16_t packetId = 0;
+    };
+
+    /**
+     * Receives the events of a Transport. Called from the transport's own thread.
+     */
+    class TransportHandler {
+    public:
+        virtual ~TransportHandler() = default;
+
+        // (Re)connection success, subscriptions have to be renewed
+        virtual void connected() = 0;
+
+        virtual void connectionLost(const std::string& cause) = 0;
+
+        virtual void messageArrived(const TransportMessage& message) = 0;
+    };
+
+    /**
+     * Minimal publish/subscribe client as used by the bridge, implemented on top
+     * of paho (PahoTransport) or the in-process LoopbackBroker (LoopbackTransport).
+     */
+    class Transport {
+    public:
+        virtual ~Transport() = default;
+
+        // Must be set before connecting
+        virtual void setHandler(TransportHandler* handler) = 0;
+
+        // Starts connecting, returns false if that failed right away
+        virtual bool connect() = 0;
+
+        virtual void disconnect() = 0;
+
+        virtual void subscribe(const std::string& topicFilter, int qos) = 0;
+
+        // Returns false if the message could not be handed over for delivery
+        virtual bool publish(const std::string& topic, const std::string& payload, int qos, bool retained) = 0;
+    };
+
+} // lm
+
+#endif //LIRC_MQTT_TRANSPORT_H
@@ -9,6 +9,7 @@
 #include <string>
 #include <thread>
 #include "MqttConsumer.h"
+#include "Tracer.h"
 #include "rapidjson/document.h"
 #include "rapidjson/filereadstream.h"
 #include <csignal>
@@ -18,7 +19,7 @@ using namespace std::chrono;
 
 /////////////////////////////////////////////////////////////////////////////
 
-std::shared_ptr<lm::DeviceStateManager> parseDeviceStates(const std::string& file) {
+std::shared_ptr<lm::DeviceStateManager> parseDeviceStates(const std::string& file, const std::string& nodeName) {
 
     rapidjson::Document root;
 
@@ -31,20 +32,80 @@ std::shared_ptr<lm::DeviceStateManager> parseDeviceStates(const std::string& fil
 
     fclose(fp);
 
-    std::string ir_service_name = root["properties"]["irServiceName"].GetString();
-    std::string discovery_topic = root["properties"]["discoveryTopic"].GetString();
-    std::string mqtt_server = root["properties"]["mqttServer"].GetString();
-    std::string device_topic_prefix = root["properties"]["deviceTopicPrefix"].GetString();
-    std::string lircd_socket_path = "/var/run/lirc/lircd";
-    if (root["properties"].HasMember("lircdSocketPath")) {
-        lircd_socket_path = root["properties"]["lircdSocketPath"].GetString();
+    const auto& propertiesJson = root["properties"];
+
+    lm::Properties properties;
+    properties.serviceName = propertiesJson["irServiceName"].GetString();
+    properties.discoveryTopic = propertiesJson["discoveryTopic"].GetString();
+    properties.mqttServer = propertiesJson["mqttServer"].GetString();
+    properties.deviceTopicPrefix = propertiesJson["deviceTopicPrefix"].GetString();
+    if (propertiesJson.HasMember("nodeName")) {
+        properties.nodeName = propertiesJson["nodeName"].GetString();
+    }
+    if (propertiesJson.HasMember("defaultNode")) {
+        properties.defaultNode = propertiesJson["defaultNode"].GetString();
+    }
+    if (propertiesJson.HasMember("nodes")) {
+        for (const auto& node : propertiesJson["nodes"].GetArray()) {
+            properties.nodes.emplace_back(node.GetString());
+        }
+    }
+    // The config file may be shared by all nodes, the command line selects one
+    if (!nodeName.empty()) {
+        properties.nodeName = nodeName;
+    }
+    if (propertiesJson.HasMember("lircdSocketPath")) {
+        properties.lircdSocketPath = propertiesJson["lircdSocketPath"].GetString();
+    }
+    if (propertiesJson.HasMember("lircdReceive")) {
+        properties.lircdReceive = propertiesJson["lircdReceive"].GetBool();
+    }
+    if (propertiesJson.HasMember("emitterGapMs")) {
+        properties.emitterGapMs = propertiesJson["emitterGapMs"].GetInt64();
+    }
+    if (propertiesJson.HasMember("transmitPriority")) {
+        properties.transmitPriority = propertiesJson["transmitPriority"].GetInt();
+    }
+    if (propertiesJson.HasMember("airtimeStatsIntervalMs")) {
+        properties.airtimeStatsIntervalMs = propertiesJson["airtimeStatsIntervalMs"].GetInt64();
+    }
+    if (propertiesJson.HasMember("traceSampleRate")) {
+        properties.traceSampleRate = propertiesJson["traceSampleRate"].GetDouble();
+    }
+    if (propertiesJson.HasMember("traceBufferSpans")) {
+        properties.traceBufferSpans = propertiesJson["traceBufferSpans"].GetUint();
+    }
+    if (propertiesJson.HasMember("traceFile")) {
+        properties.traceFile = propertiesJson["traceFile"].GetString();
+    }
+    if (propertiesJson.HasMember("duplicateWindowMs")) {
+        properties.duplicateWindowMs = propertiesJson["duplicateWindowMs"].GetInt64();
+    }
+    if (propertiesJson.HasMember("optimisticState")) {
+        properties.optimisticState = propertiesJson["optimisticState"].GetBool();
+    }
+    if (propertiesJson.HasMember("sharedStateName")) {
+        properties.sharedStateName = propertiesJson["sharedStateName"].GetString();
+    }
+    if (propertiesJson.HasMember("outboundBufferTopics")) {
+        properties.outboundBufferTopics = propertiesJson["outboundBufferTopics"].GetUint();
+    }
+    if (propertiesJson.HasMember("outboundBufferFile")) {
+        properties.outboundBufferFile = propertiesJson["outboundBufferFile"].GetString();
     }
 
-    auto deviceStateManager = std::make_shared<lm::DeviceStateManager>(lm::Properties{ir_service_name, discovery_topic, mqtt_server, device_topic_prefix, lircd_socket_path});
+    auto deviceStateManager = std::make_shared<lm::DeviceStateManager>(properties);
 
     for (const auto& l : root["devices"].GetArray()) {
         deviceStateManager->addDeviceState(l);
     }
+    deviceStateManager->sealConfiguration();
+
+    std::cout << "Device configuration uses " << deviceStateManager->memoryUsage() << " bytes" << std::endl;
+    if (!properties.nodeName.empty()) {
+        std::cout << "Running as node " << properties.nodeName << " with " << deviceStateManager->getLocalDeviceNames().size()
+                  << " of " << deviceStateManager->getDeviceNames().size() << " devices" << std::endl;
+    }
 
     return deviceStateManager;
 }
@@ -52,6 +113,8 @@ std::shared_ptr<lm::DeviceStateManager> parseDeviceStates(const std::string& fil
 namespace {
     std::function<void(int)> shutdown_handler;
     void signal_handler(int signal) { shutdown_handler(signal); }
+    std::function<void(int)> dump_handler;
+    void dump_signal_handler(int signal) { dump_handler(signal); }
 }
 
 int main(int argc, char* argv[])
@@ -63,9 +126,12 @@ int main(int argc, char* argv[])
 
     cout << "Starting lirc-mqtt..."<< std::endl;
     cout << "Loading configuration from " << argv[1] << std::endl;
-    auto deviceStateManager = parseDeviceStates(argv[1]);
+    auto deviceStateManager = parseDeviceStates(argv[1], argc > 2 ? argv[2] : "");
+
+    const lm::Properties& properties = deviceStateManager->getProperties();
+    auto tracer = std::make_shared<lm::Tracer>(properties.traceSampleRate, properties.traceBufferSpans, properties.traceFile);
 
-    auto mqttConsumer = std::make_shared<lm::MqttConsumer>(deviceStateManager);
+    auto mqttConsumer = std::make_shared<lm::MqttConsumer>(deviceStateManager, tracer);
 
     // register signal SIGABRT and signal handler
     signal(SIGABRT, signal_handler);
@@ -76,6 +142,15 @@ int main(int argc, char* argv[])
         mqttConsumer->stop();
     };
 
+    // Airtime stats, and the trace if tracing is enabled
+    dump_handler = [mqttConsumer, tracer] (int signal_num) {
+        mqttConsumer->requestStats();
+        if (tracer->isEnabled()) {
+            tracer->requestDump();
+        }
+    };
+    signal(SIGUSR1, dump_signal_handler);
+
     return mqttConsumer->consume();
 }
 